@@ -23,7 +23,38 @@
 #include "mbed.h"
 #include "AT45.h"
 
-#define AT45_OUT_OF_MEMORY -4002
+// Typical operation times, used as hints by the ready wait strategies
+#define AT45_T_XFR_US     200      // main memory page to buffer transfer
+#define AT45_T_EP_US      17000    // page erase and programming
+#define AT45_T_P_US       3000     // page programming without built-in erase
+#define AT45_T_PE_US      15000    // page erase
+#define AT45_T_BE_US      45000    // block erase
+#define AT45_T_SE_US      1600000  // sector erase
+#define AT45_T_CE_US      80000000 // chip erase
+#define AT45_T_RDPD_US    35       // deep power down to standby
+#define AT45_T_XUDPD_US   120      // ultra-deep power down to standby
+
+#if AT45_STATS_ENABLED
+// Count and time the outermost public operation of a type, the calls it makes are part of it
+#define AT45_STAT_OP(op, bytes) OpTimer optimer(this, &_stats.op, (bytes))
+#else
+#define AT45_STAT_OP(op, bytes)
+#endif
+
+// Pages whose spare bytes are read per step of the sequence number scan
+#define AT45_SEQ_SCAN_PAGES 8
+
+// Bounds of the status poll interval in WAIT_SLEEP mode
+#define AT45_POLL_MIN_US  50
+#define AT45_POLL_MAX_US  10000
+
+#if DEVICE_SPI_ASYNCH
+// States of the asynchronous page transfers
+#define AT45_ASYNC_IDLE          0
+#define AT45_ASYNC_READ          1
+#define AT45_ASYNC_WRITE_FILL    2
+#define AT45_ASYNC_WRITE_PROGRAM 3
+#endif
 
 //=============================================================================
 // Public functions
@@ -31,248 +62,254 @@
 
 AT45::AT45(DestructableSPI* spi, PinName ncs) : _spi(spi), _ncs(ncs)
 {
-
-    _pages = -1;        // number of pages
-    _pagesize = -1;     // size of pages 256/264, 512/528, 1024/1056
-    _devicesize = -1;   // In bytes
-    _deep_down = true; // variable for deep power down function (awake ?)
-    _deep_down_onoff = false; // variable for deep power down function (On/Off)
+    _defaults();
 
     _initialize();     // Populate all this stuff
 
+    _expect(0);        // state left behind by a previous owner is unknown, poll once before the first command
+
+}
+
+AT45::AT45(DestructableSPI* spi, PinName ncs, Part part, bool binary) : _spi(spi), _ncs(ncs)
+{
+    _defaults();
+
+    _geometry(part, binary ? 0x1 : 0x0); // no SPI traffic, probe() reads the device
+
+    _expect(0);        // state left behind by a previous owner is unknown, poll once before the first command
+
+}
+
+AT45::~AT45()
+{
+    _freeirq();
+}
+
+int AT45::probe()
+{
+    _initialize();
+    _integrity = false;
+    _invalidate (0, 0x7fffffff); // the page addressing may have changed
+
+    return (_pagesize > 0) ? 0 : -1;
 }
 
 // This function returns the char
 char AT45::read_byte(int address)
 {
+    AT45_STAT_OP (read, 1);
+
     // return byte from address
     return (_memread( address ));
 }
 
 int AT45::read_page(char* data, int page)
 {
-    int address = -1;
+    AT45_STAT_OP (read, _datasize);
 
-    if(_pagesize == 256)
-    {
-        address = page * 256;
-    }
-    else if(_pagesize == 264)
-    {
-        address = page * 512;
-    }
-    else if(_pagesize == 512)
-    {
-        address = page * 512;
-    }
-    else if(_pagesize == 528)
-    {
-        address = page * 1024;
-    }
-    else if(_pagesize == 1024)
-    {
-        address = page * 1024;
-    }
-    else if(_pagesize == 1056)
-    {
-        address = page * 2048;
-    }
-    else
+    int address = _pageaddress(page);
+
+    if (address < 0)
     {
         return (-1); // something isnt configured right
     }
 
-    _busy();
-    _flashread(1,address); // read the first page of the block into SRAM buffer 1
-    _busy();               // Wait until First page has loaded into buffer 1
+    // skips the main memory to buffer transfer when a buffer already holds the page
+    int buffer = _loadbuffer(address);
 
     // this is done directly as we are reading back an entire buffer, and this can be done more optimally than using _sramread
     _select();
-    _spi->write(0xd4);
-    _sendaddr (0x0);
-    _spi->write (0x0);   // dont care byte
-
-    for(int i=0; i<_pagesize ;i++)
+    _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, 0x0, 1); // opcode, buffer address and dont care byte
+    _readdata (data, _datasize);
+    if (_integrity)
     {
-        data[i] = _spi->write (0x0);
+        char spare[32];
+
+        _readdata (spare, _pagesize - _datasize); // the spare bytes follow in the same transfer
+        _deselect();
+
+        return (_checkspare(spare, data));
     }
     _deselect();
 
     return (0);
 }
-int AT45::read_block(char *data, int block)  // under construction F&#65533;R CHECK AF MIC OG LERCHE
+int AT45::read_continuous(char* data, int address, int length)
 {
-    char* temp_data = (char*)malloc(_pagesize);
-
-    if (!temp_data) return AT45_OUT_OF_MEMORY;
-
-    int page_start;
+    AT45_STAT_OP (read, length);
 
-    if (block < _blocks || block == 0) {
-        page_start = block * 8;
-
-        for (int i=0; i<8; i++) {
-            read_page(temp_data, page_start);
-            //printf("%d Read round, Data is: %d\r\n",i,*temp_data);
-            page_start = page_start + 1;
-            for (int z=0; z<_pagesize ; z++) {
-                data[z+(_pagesize*i)] = temp_data[z];
-            }
-        }
-    } else {
-        //do nothing
+    if ((_datasize <= 0) || (address < 0) || (length < 0) || (address + length > _pages * _datasize))
+    {
+        return (-1); // something isnt configured right
     }
-    free(temp_data);
-
-    //printf("Read done, Data is: %d\r\n",*data);
-    return (0);
-}
-
-int AT45::read_block(char *data[], int block)       // under construction F&#65533; CHECK AF MIC OG LERCHE
-{
-    char* temp_data = (char*)malloc(_pagesize);
 
-    if (!temp_data) return AT45_OUT_OF_MEMORY;
+    int r = 0;
 
-    int page_start;
+    _busy(); // the array has to be idle for a main memory read
 
-    if(block < _blocks || block == 0)
+    while (length > 0)
     {
-        page_start = block * 8;
+        int page = address / _datasize;
+        int offset = address % _datasize;
+        int chunk = length;
 
-        for(int i=0; i<8 ;i++)                         // 8 pages in a block
+        if (_datasize != _pagesize)
         {
-            read_page(temp_data, page_start);
-            page_start = page_start + 1;
-            for(int z=0; z<_pagesize ;z++)
+            // binary view, stop before the spare bytes of each page
+            chunk = _datasize - offset;
+            if (chunk > length)
             {
-                data[i][z] = temp_data[z];
+                chunk = length;
             }
         }
-    }
-    else
-    {
-        //do nothing
-    }
 
-    free(temp_data);
+        // Continuous array read, the device wraps into the next page by itself
+        _select();
+        _sendcmd (0x0b, _pageaddress(page) | offset, 1); // opcode, address and dont care byte
+        _readdata (data, chunk);
+        if (_integrity && (chunk == _datasize))
+        {
+            char spare[32];
 
-    return (0);
-}
+            _readdata (spare, _pagesize - _datasize); // the spare bytes follow the page data
+            if ((_checkspare(spare, data) != 0) && (r == 0))
+            {
+                r = AT45_CRC_MISMATCH; // keep reading, report the first bad page
+            }
+        }
+        _deselect();
 
-// This function writes the char to the address supplied
-// Note : We pass the raw address to the underlying functions
-void AT45::write_byte(int address, char data)
-{
-    _busy();
-    _flashread(1,address);             // read the Flash page into SRAM buffer
-    _busy();                           // wait for the read to complete
-    _sramwrite(1,address,data);        // Write new data into SRAM
-    _busy();                           // Make sure flash isnt busy
-    _flashwrite(1,address);            // Write back to the page address
+        address += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+
+    return (r);
 }
 
-int AT45::write_page(char* data, int page)
+int AT45::read_bytes(int address, char* data, int length)
 {
-    int address = -1;
+    AT45_STAT_OP (read, length);
 
-    if(_pagesize == 256)
-    {
-        address = page * 256;
-    }
-    else if(_pagesize == 264)
-    {
-        address = page * 512;
-    }
-    else if(_pagesize == 512)
-    {
-        address = page * 512;
-    }
-    else if(_pagesize == 528)
-    {
-        address = page * 1024;
-    }
-    else if(_pagesize == 1024)
-    {
-        address = page * 1024;
-    }
-    else if(_pagesize == 1056)
-    {
-        address = page * 2048;
-    }
-    else
+    if ((_datasize <= 0) || (address < 0) || (length < 0) || (address + length > _pages * _datasize))
     {
         return (-1); // something isnt configured right
     }
 
-    _select();
-    _spi->write(0x84); // writing to buffer #1
-    _sendaddr (0); // we are writing to the entire buffer
+    int page = address / _datasize;
+    int offset = address % _datasize;
 
-    for(int i=0; i<_pagesize ;i++)
+    if (_integrity && (offset == 0) && (length == _datasize))
     {
-        _spi->write (data[i]);
+        return (read_page(data, page)); // a whole page is checked against its record
     }
-    _deselect();
 
-    _busy(); // make sure the Flahs isnt busy
+    // a range inside one page is served from a buffer holding the page, unless it may still be programming from it
+    int buffer = ((offset + length) <= _datasize) ? _buffered(_pageaddress(page)) : 0;
+    if ((buffer != 0) && ((buffer != _program_buffer) || !_inflight))
+    {
+        _select();
+        _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, offset, 1); // opcode, buffer address and dont care byte
+        _readdata (data, length);
+        _deselect();
 
-    // issue command to write buffer 1 to the appropraite flash page
-    _select();
-    _spi->write (0x83);
-    _sendaddr (_getpaddr(address));
-    _deselect();
+        return (0);
+    }
 
-    return (0);
+    // one opcode for the whole range, the device wraps across page boundaries
+    return (read_continuous(data, address, length));
 }
-int AT45::write_block(char *data, int block) // under construction F&#65533;R CHECK AF MIC OG LERCHE
+
+int AT45::read_bytesv(int address, const at45_iovec_t* iov, int count)
 {
+    AT45_STAT_OP (read, _iovlength(iov, count));
 
-    int page_start;
-    char* page_arr = (char*)malloc(_pagesize);
+    int length = _iovlength(iov, count);
+    int seg = 0;
+    int skip = 0;
+    int r = 0;
 
-    if (!page_arr) return AT45_OUT_OF_MEMORY;
+    if ((_datasize <= 0) || (address < 0) || (length < 0) || (address + length > _pages * _datasize))
+    {
+        return (-1); // something isnt configured right
+    }
 
-    if (block < _blocks || block == 0)
+    _busy(); // the array has to be idle for a main memory read
+
+    while (length > 0)
     {
-        page_start = block * 8;
+        int page = address / _datasize;
+        int offset = address % _datasize;
+        int chunk = length;
+
+        if (_datasize != _pagesize)
+        {
+            // binary view, stop before the spare bytes of each page
+            chunk = _datasize - offset;
+            if (chunk > length)
+            {
+                chunk = length;
+            }
+        }
 
-        for (int i=0; i<8 ; i++)
+        int first = seg;
+        int firstskip = skip;
+
+        // Continuous array read, scattered into the segments while chip select stays low
+        _select();
+        _sendcmd (0x0b, _pageaddress(page) | offset, 1); // opcode, address and dont care byte
+        _readdatav (iov, &seg, &skip, chunk);
+        if (_integrity && (chunk == _datasize))
         {
-            // Copy data from *data at 0 to 511 _ 512 - 1023, and so on every round.
-            memcpy(page_arr, &data[_pagesize*i], _pagesize);
+            char spare[32];
 
-            write_page(page_arr, page_start);
-            page_start = page_start + 1;
+            _readdata (spare, _pagesize - _datasize); // the spare bytes follow the page data
+            if ((_checkrecord(spare, _crcv(iov, first, firstskip, chunk)) != 0) && (r == 0))
+            {
+                r = AT45_CRC_MISMATCH; // keep reading, report the first bad page
+            }
         }
-    } else {
-        //do nothing
-    }
+        _deselect();
 
-    free(page_arr);
+        address += chunk;
+        length -= chunk;
+    }
 
-    return (0);
+    return (r);
 }
-int AT45::write_block(char *data[], int block)      // under construction F&#65533; CHECK AF MIC OG LERCHE
+
+int AT45::read_block(char *data, int block)
 {
-    char* temp_data = (char*)malloc(_pagesize);
+    AT45_STAT_OP (read, 8 * _datasize);
+
+    if (block < _blocks || block == 0)
+    {
+        // the 8 pages of the block in one continuous array read, straight into the caller's buffer
+        return (read_continuous(data, block * 8 * _datasize, 8 * _datasize));
+    }
+    else
+    {
+        //do nothing
+    }
 
-    if (!temp_data) return AT45_OUT_OF_MEMORY;
+    return (0);
+}
 
-    int page_start;
+int AT45::read_block(char *data[], int block)
+{
+    AT45_STAT_OP (read, 8 * _datasize);
 
-    if(block < _blocks || block == 0)
+    if (block < _blocks || block == 0)
     {
-        page_start = block * 8;
+        int page_start = block * 8;
 
-        for(int i=0; i<8 ;i++)
+        for (int i=0; i<8 ;i++)                         // 8 pages in a block
         {
-            for(int z=0; z<_pagesize ;z++)
+            int r = read_page(data[i], page_start + i);
+            if (r != 0)
             {
-               temp_data[z] = data[i][z];
+                return (r);
             }
-            write_page(temp_data, page_start);
-            page_start = page_start + 1;
         }
     }
     else
@@ -280,678 +317,2158 @@ int AT45::write_block(char *data[], int block)      // under construction F&#655
         //do nothing
     }
 
-    free(temp_data);
-
     return (0);
 }
 
-int AT45::FAT_read(char* data, int page)
+// This function writes the char to the address supplied
+// Note : We pass the raw address to the underlying functions
+void AT45::write_byte(int address, char data)
 {
-    // For 256 byte pages, we read two pages
-    if((_pagesize == 256) || (_pagesize == 264))
-    {
-        int address = page * 512; // This is the start address of the 512 byte block
+    AT45_STAT_OP (program, 1);
+
+    _patch (_getpaddr(address), _getbaddr(address), &data, 1, true);
+}
 
-        _flashread(1,address); // read the first page of the block into SRAM buffer 1
-        _busy(); // Wait until First page has loaded into buffer 1
+int AT45::write_bytes(int address, const char* data, int length)
+{
+    AT45_STAT_OP (program, length);
 
-        // this is done directly as we are reading back an entire buffer, and this can be done more optimally than using _sramread
-        _select();
-        _spi->write(0xd4);
-        _sendaddr (0x0);
-        _spi->write (0x0);   // dont care byte
+    if ((_datasize <= 0) || (address < 0) || (length < 0) || (address + length > _pages * _datasize))
+    {
+        return (-1); // something isnt configured right
+    }
+
+    // every touched page is loaded, patched and programmed exactly once
+    while (length > 0)
+    {
+        int page = address / _datasize;
+        int offset = address % _datasize;
+        int chunk = _datasize - offset;
 
-        for(int i=0;i<256;i++)
+        if (chunk > length)
         {
-            data[i] = _spi->write (0x0);
+            chunk = length;
         }
-        _deselect();
 
-        _flashread(1,address+256); // read the second page of the block into SRAM buffer 2
-        _busy(); // Wait until second page has loaded into buffer 2
+        int r;
 
-        // Now the second page is loaded, pull this out into the second half of the data buffer
-        // this is done directly as we are reading back an entire buffer, and this can be done more optimally than using _sramread
-        _select();
-        _spi->write(0xd4);
-        _sendaddr (0x0);
-        _spi->write (0x0);   // dont care byte
+        if (chunk == _datasize)
+        {
+            r = write_page(data, page); // nothing to keep, skip the read-modify-write
+        }
+        else
+        {
+            r = _patch (_pageaddress(page), offset, data, chunk, true);
+        }
 
-        for(int i=0;i<256;i++)
+        if (r != 0)
         {
-            data[256+i] = _spi->write (0x0);
+            return (r);
         }
-        _deselect();
-        return (0);
+
+        address += chunk;
+        data += chunk;
+        length -= chunk;
     }
 
-    // For 512 byte pages, we read just the single page, transfer it
-    else if((_pagesize == 512) || (_pagesize == 528))
-    {
-        int address = page * 512; // This is the start address of the 512 byte block
+    return (0);
+}
 
-        _busy(); // Wait until First page has loaded into buffer 1
-        _flashread(1,address); // read the first page of the block into SRAM buffer 1
-        _busy(); // Wait until First page has loaded into buffer 1
+int AT45::write_page(const char* data, int page, bool erase)
+{
+    AT45_STAT_OP (program, _datasize);
 
-        // Now the page has loaded, simply transfer it from the sram buffer to the data array
-        // this is done directly as we are reading back an entire buffer, and this can be done more optimally than using _sramread
-        _select();
-        _spi->write(0xd4);
-        _sendaddr (0x0);
-        _spi->write (0x0);   // dont care byte
+    int address = _pageaddress(page);
 
-        for(int i=0;i<512;i++)
-        {
-            data[i] = _spi->write (0x0);
-        }
-        _deselect();
-        return (0);
+    if (address < 0)
+    {
+        return (-1); // something isnt configured right
     }
 
-    // For 1024 byte pages, we read just a single page, transfer half of it
-    else if((_pagesize == 1024) || (_pagesize == 1056))
-    {
-        int address = _getpaddr(page * 512); // This is the start address of the 512 byte block
+    // fill the buffer that is not being programmed into the array right now,
+    // so the SPI transfer overlaps with the previous page program
+    int buffer = _fillbuffer();
 
-        _busy(); // Wait until First page has loaded into buffer 1
+    _bufferwrite (buffer, 0, data, _datasize); // writing the entire buffer
+    _sealspare (buffer, data);
 
-        _flashread(1,address); // read the first page of the block into SRAM buffer 1
+    return (_program (buffer, address, erase)); // waits for the previous page program to finish
+}
 
-        _busy(); // Wait until First page has loaded into buffer 1
+int AT45::buffer_write(int buffer, int offset, const char* data, int length)
+{
+    if ((buffer < 1) || (buffer > 2) || (offset < 0) || (length < 0) || (offset + length > _datasize))
+    {
+        return (-1); // something isnt configured right
+    }
 
-        // Now the page has loaded, simply transfer it from the sram buffer to the data array
-        // this is done directly as we are reading back an entire buffer, and this can be done more optimally than using _sramread
+    _bufferwrite (buffer, offset, data, length);
 
-        _select();
-        _spi->write(0xd4);
+    return (0);
+}
 
-        if (page %2) // odd numbered block, read from adress 0x200
-        {
-            _sendaddr (0x200);
-        }
-        else // even numbered block, then we are reading from sram buffer 0x0
-        {
-            _sendaddr (0x0);
-        }
+int AT45::buffer_program(int buffer, int page, bool erase)
+{
+    AT45_STAT_OP (program, _datasize);
 
-        _spi->write (0x0);   // dont care byte
+    int address = _pageaddress(page);
 
-        for(int i=0;i<512;i++)
-        {
-            data[i] = _spi->write (0x0);
-        }
-        _deselect();
-        return (0);
-    }
-    else
+    if ((address < 0) || (buffer < 1) || (buffer > 2))
     {
         return (-1); // something isnt configured right
     }
+
+    _sealspare (buffer, NULL);
+
+    return (_program (buffer, address, erase));
 }
 
-int AT45::FAT_write(char* data, int page)
+int AT45::buffer_load(int page)
 {
-    // For 256 byte pages, we overwrite two pages
-    if((_pagesize == 256) || (_pagesize == 264))
+    int address = _pageaddress(page);
+
+    if (address < 0)
     {
+        return (-1); // something isnt configured right
+    }
 
-        // fill the first buffer with the first half of the block
-        // do this directly, for better performance
-        _select();
-        _spi->write(0x84); // writing to buffer #1
-        _sendaddr (0); // we are writing to the entire buffer
+    return (_loadbuffer (address));
+}
 
-        for(int i=0;i<256;i++) {
-            _spi->write (data[i]);
-        }
-        _deselect();
+int AT45::buffer_reserve(int buffer)
+{
+    if ((buffer < 0) || (buffer > 2))
+    {
+        return (-1); // something isnt configured right
+    }
 
-        _flashwrite(1,(page*512));
+    _reserved = buffer;
 
-        // fill the buffer with the second half of the block
-        // do this directly, for better performance
-        _select();
-        _spi->write(0x84); // writing to buffer #1
-        _sendaddr (0); // we are writing to the entire buffer
+    return (0);
+}
 
-        for(int i=0;i<256;i++) {
-            _spi->write (data[256+i]);
-        }
-        _deselect();
+int AT45::program_buffer()
+{
+    return (_program_buffer);
+}
 
-        _flashwrite(1,((page*512)+256));
-    }
+int AT45::write_partial(const char* data, int page, int offset, int length, bool erase)
+{
+    AT45_STAT_OP (program, length);
 
-    // For 512 byte pages, we overwrite a single page
-    else if((_pagesize == 512) || (_pagesize == 528))
+    int address = _pageaddress(page);
+
+    if ((address < 0) || (offset < 0) || (length < 0) || (offset + length > _datasize))
     {
+        return (-1); // something isnt configured right
+    }
 
-        // fill the first buffer with the block data
-        // do this directly, for better performance
-        _select();
-        _spi->write(0x84); // writing to buffer #1
-        _sendaddr (0); // we are writing to the entire buffer
+    return (_patch (address, offset, data, length, erase));
+}
 
-        for(int i=0;i<512;i++) {
-            _spi->write (data[i]);
-        }
-        _deselect();
+int AT45::write_bytesv(int address, const at45_iovec_t* iov, int count, bool erase)
+{
+    AT45_STAT_OP (program, _iovlength(iov, count));
 
-        _busy(); // make sure the Flahs isnt busy
+    int length = _iovlength(iov, count);
+    int seg = 0;
+    int skip = 0;
 
-        // issue command to write buffer 1 to the appropraite flash page
-        _select();
-        _spi->write (0x83);
-        _sendaddr (_getpaddr(page * 512));
-        _deselect();
+    if ((_datasize <= 0) || (address < 0) || (length < 0) || (address + length > _pages * _datasize))
+    {
+        return (-1); // something isnt configured right
     }
 
-    // For 1024 byte pages, we do a read modify write
-    // must make sure we overwrite the right half of the page!
-    else if((_pagesize == 1024) || (_pagesize == 1056))
+    // every touched page is filled once, with the segments gathered in one buffer write, and programmed once
+    while (length > 0)
     {
+        int page = address / _datasize;
+        int offset = address % _datasize;
+        int paddr = _pageaddress(page);
+        int chunk = _datasize - offset;
+        int buffer;
 
-        _busy(); // make sure the flash isnt busy
+        if (chunk > length)
+        {
+            chunk = length;
+        }
 
-        int address = _getpaddr(page*512);
+        if (chunk == _datasize)
+        {
+            // nothing to keep, fill the buffer that is not being programmed
+            buffer = _fillbuffer();
+        }
+        else
+        {
+            // read-modify-write, skips the transfer when a buffer already holds the page
+            buffer = _loadbuffer(paddr);
+        }
 
-        // Read the page into sram
-        _flashread(1,address);
+        if (buffer == _program_buffer)
+        {
+            _busy(); // the buffer may still be programming into the array
+        }
 
-        // wait for this operation to complete
-        _busy();
+        int first = seg;
+        int firstskip = skip;
 
-        // Overwrite the appropriate half
-        // do this directly, for better performance
+        _bufpaddr[buffer - 1] = -1;
         _select();
-        _spi->write(0x84); // writing to buffer #1
+        _sendcmd ((buffer == 1) ? 0x84 : 0x87, offset);
+        _writedatav (iov, &seg, &skip, chunk);
+        _deselect();
 
-        if(page%2)  // this is an odd block number, overwrite second half of buffer
+        if (chunk == _datasize)
         {
-            _sendaddr (0x200); // we are writing to the entire buffer
+            _sealrecord (buffer, _integrity ? _crcv(iov, first, firstskip, chunk) : 0);
         }
-        else        // this is an even block, overwrite the first half
+        else if (_integrity)
         {
-            _sendaddr (0x0); // we are writing to the entire buffer
+            _sealspare (buffer, NULL); // the record covers the bytes kept from the page
         }
 
-        for(int i=0;i<512;i++)
+        int r = _program (buffer, paddr, erase);
+        if (r != 0)
         {
-            _spi->write (data[i]);
+            return (r);
         }
-        _deselect();
 
-        // Write the page back
-        _busy();
-        _flashwrite(1,address);
+        address += chunk;
+        length -= chunk;
     }
 
-    // Something has gone wrong
-    else
+    return (0);
+}
+
+int AT45::page_rewrite(int page)
+{
+    AT45_STAT_OP (program, _datasize);
+
+    int address = _pageaddress(page);
+
+    if (address < 0)
     {
-        return (-1);
+        return (-1); // something isnt configured right
     }
 
+    // keep the buffer of the last page program, it still mirrors that page
+    int buffer = _fillbuffer();
+
+    _busy(); // make sure the array is idle
+
+    // Auto Page Rewrite, loads the page into the buffer and programs it back with built-in erase
+    _select();
+    _sendcmd ((buffer == 1) ? 0x58 : 0x59, address);
+    _deselect();
+    _expect (AT45_T_EP_US);
+
+    _program_buffer = buffer;
+    _mirror (buffer, address);
+
     return (0);
 }
 
-// Erase the entire chip
-void AT45::chip_erase()
+int AT45::write_pages(const char* data, int page, int count, bool erase)
 {
-    _busy(); // make sure flash isnt already in busy.
+    AT45_STAT_OP (program, count * _datasize);
 
-    _select();
-    // 4 byte command sequence
-    _spi->write(0xc7);
-    _spi->write(0x94);
-    _spi->write(0x80);
-    _spi->write(0x9a);
-    _deselect();
+    // write_page alternates between the two SRAM buffers, so every fill after
+    // the first one runs while the previous page is programming
+    for (int i = 0; i < count; i++)
+    {
+        int r = write_page(&data[_datasize * i], page + i, erase);
+        if (r != 0)
+        {
+            return (r);
+        }
+    }
 
-    _busy(); // Make erase a blocking function
+    return (0);
 }
 
-// Erase one block
-void AT45::block_erase(int block)
+int AT45::read_spare(char* data, int page)
 {
-    int address = -1;
+    AT45_STAT_OP (read, _pagesize - _datasize);
 
-    // Calculate page addresses
-    if(block < _blocks || block == 0)
+    int address = _pageaddress(page);
+
+    if ((address < 0) || (_datasize == _pagesize))
     {
-        if(_pagesize == 256)
-        {
-            address = block * 2048;
-        }
-        else if(_pagesize == 264)
-        {
-            address = block * 4096;
-        }
-        else if(_pagesize == 512)
-        {
-            address = block * 4096;
-        }
-        else if(_pagesize == 528)
-        {
-            address = block * 8192;
-        }
-        else if(_pagesize == 1024)
-        {
-            address = block * 8192;
-        }
-        else if(_pagesize == 1056)
-        {
-            address = block * 16384;
-        }
+        return (-1); // no binary view, the spare bytes hold page data
+    }
 
-        _busy();
+    // a buffer holding the page serves it, unless it may still be programming from it
+    int buffer = _buffered(address);
+    if ((buffer != 0) && ((buffer != _program_buffer) || !_inflight))
+    {
         _select();
-        _spi->write(0x50);
-        _sendaddr (address);
+        _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, _datasize, 1); // opcode, buffer address and dont care byte
+        _readdata (data, _pagesize - _datasize);
         _deselect();
-        _busy();
+
+        return (0);
     }
-    else
+
+    _busy(); // the array has to be idle for a main memory read
+
+    _select();
+    _sendcmd (0x0b, address | _datasize, 1); // opcode, address and dont care byte
+    _readdata (data, _pagesize - _datasize);
+    _deselect();
+
+    return (0);
+}
+
+int AT45::write_spare(const char* data, int page, bool erase)
+{
+    AT45_STAT_OP (program, _pagesize - _datasize);
+
+    int address = _pageaddress(page);
+
+    if ((address < 0) || (_datasize == _pagesize) || _integrity)
     {
-        //do nothing
+        return (-1); // no binary view, or the spare bytes hold the integrity record
     }
+
+    // read-modify-write, the data bytes of the page keep their contents
+    return (_patch (address, _datasize, data, _pagesize - _datasize, erase));
 }
 
-// Erase one page
-void AT45::page_erase(int page)
+int AT45::read_spares(char* data, int page, int count)
 {
-    int address = -1;
+    AT45_STAT_OP (read, count * (_pagesize - _datasize));
 
-    // Calculate page addresses
-    if(page < _pages || page == 0)
+    if ((_datasize == _pagesize) || (page < 0) || (count < 0) || (page + count > _pages))
     {
-        if(_pagesize == 256)
-        {
-            address = page * 256;
-        }
-        else if(_pagesize == 264)
-        {
-            address = page * 512;
-        }
-        else if(_pagesize == 512)
-        {
-            address = page * 512;
-        }
-        else if(_pagesize == 528)
-        {
-            address = page * 1024;
-        }
-        else if(_pagesize == 1024)
-        {
-            address = page * 1024;
-        }
-        else if(_pagesize == 1056)
-        {
-            address = page * 2048;
-        }
+        return (-1); // no binary view, the spare bytes hold page data
+    }
 
-        _busy();
+    _busy(); // the array has to be idle for a main memory read
+
+    for (int i = 0; i < count; i++)
+    {
         _select();
-        _spi->write(0x81);
-        _sendaddr (address);
+        _sendcmd (0x0b, _pageaddress(page + i) | _datasize, 1); // opcode, address and dont care byte
+        _readdata (data, _pagesize - _datasize);
         _deselect();
-        _busy();
-    }
-    else
-    {
-        //do nothing
-    }
-}
 
-// return the size of the part in bytes
-int AT45::device_size()
-{
-    return _devicesize;
-}
+        data += _pagesize - _datasize;
+    }
 
-// return the numbers of pages
-int AT45::pages()
-{
-    return _pages;
+    return (0);
 }
 
-// return the page size of the part in bytes
-int AT45::pagesize()
+int AT45::write_page_spare(const char* data, const char* spare, int page, bool erase)
 {
-    return _pagesize;
-}
+    AT45_STAT_OP (program, _pagesize);
 
-// A one-time programmable configuration
-void AT45::set_pageszie_to_binary()
-{
-    _busy(); // make sure flash isnt already in busy.
+    int address = _pageaddress(page);
 
-    _select();
-    // 4 byte command sequence
-    _spi->write(0x3d);
-    _spi->write(0x2a);
-    _spi->write(0x80);
-    _spi->write(0xa6);
-    _deselect();
+    if ((address < 0) || (_datasize == _pagesize) || _integrity)
+    {
+        return (-1); // no binary view, or the spare bytes hold the integrity record
+    }
 
-    _busy(); // Make erase a blocking function
-}
+    int buffer = _fillbuffer();
 
-// Return the number of blocks in this device in accordance with the datasheet
-int AT45::blocks()
-{
-    return _blocks;
-}
+    if (data != NULL)
+    {
+        _bufferwrite (buffer, 0, data, _datasize);
+    }
+    else
+    {
+        static const char erased[32] = {
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+        };
 
-// Return the Id of the part
-int AT45::id()
-{
-    int id = 0;
-    _select();
-    _spi->write(0x9f);
-    id = (_spi->write(0x00) << 8);
-    id |= _spi->write(0x00);
-    _deselect();
-    return id;
-}
+        for (int offset = 0; offset < _datasize; offset += sizeof(erased))
+        {
+            _bufferwrite (buffer, offset, erased, sizeof(erased)); // the data sizes are multiples of 32
+        }
+    }
+    _bufferwrite (buffer, _datasize, spare, _pagesize - _datasize);
 
-// return the Status
-int AT45::status()
-{
-    int status = 0;
-    _select();
-    _spi->write(0xd7);
-    status = (_spi->write(0x00));
-    _deselect();
-    return status;
+    return (_program (buffer, address, erase));
 }
 
-// Make sure the Flash isnt already doing something
-void AT45::busy()
+int AT45::verify_page(const char* data, int page)
 {
-    _busy();
-}
+    int address = _pageaddress(page);
 
-void AT45::deep_power_down(bool _deep_down_onoff)
-{
-    if(_deep_down_onoff == false) // Wake up from deep power down
+    if (address < 0)
     {
-        _select();
-        _spi->write(0xab);
-        _deselect();
-        _deep_down = true;
-        // remenber to want 35uS before using the device.
+        return (-1); // something isnt configured right
     }
-    else if(_deep_down_onoff == true) // Go to deep power down
+
+    int buffer = _fillbuffer();
+
+    if (_datasize != _pagesize)
     {
+        // the compare covers the whole page, take the spare bytes from the page itself
         _busy();
         _select();
-        _spi->write(0xb9);
+        _sendcmd ((buffer == 1) ? 0x53 : 0x55, address);
         _deselect();
-        _deep_down = false;
-    }
-    else
-    {
-        //do nothing
+        _expect (AT45_T_XFR_US);
+
+        _busy(); // Wait until the page has loaded into the buffer, the fill below would race it
     }
+
+    _bufferwrite (buffer, 0, data, _datasize);
+
+    return (_compare (buffer, address));
 }
 
-bool AT45::is_it_awake()
+void AT45::set_program_verify(bool onoff)
 {
-    return _deep_down;
+    _verify = onoff;
 }
 
-//=============================================================================
-// Private functions
-//=============================================================================
-
-void AT45::_initialize()
+int AT45::set_integrity(bool onoff)
 {
-    int _id = 0;
-    int _status = 0;
-
-    _id = id();
-    _status = status();
+    if (onoff && ((_datasize == _pagesize) || (_pagesize - _datasize < AT45_SPARE_RECORD)))
+    {
+        return (-1); // needs the spare bytes of the binary view
+    }
 
-    if ((_id & 0x1f) == 0x3)  // 2Mbits
+    if (onoff)
     {
-        _devicesize = 262144; // Size in bytes
-        _pages = 1024;        // Number of pages
-        _blocks = 128;        // Number of blocks
-        if (_status & 0x1)
+        char erased[64];
+        MbedCRC<POLY_32BIT_ANSI, 32> ct;
+
+        // CRC of an erased page, pages without a record are accepted when their data is erased
+        memset (erased, 0xff, sizeof(erased));
+        ct.compute_partial_start(&_erasedcrc);
+        for (int done = 0; done < _datasize; done += sizeof(erased))
         {
-            _pagesize = 256;
+            ct.compute_partial((void*)erased, sizeof(erased), &_erasedcrc);
         }
-        else
+        ct.compute_partial_stop(&_erasedcrc);
+
+        // programs from here on are ordered after every record on the device,
+        // the spare bytes are scanned by the first page program rather than here
+        if (!_integrity)
         {
-            _pagesize = 264;
+            _seqknown = false;
         }
     }
-    else if ( (_id & 0x1f) == 0x4) // 4Mbits
+
+    _integrity = onoff;
+
+    return (0);
+}
+
+int AT45::spare_digest(int page, int count, uint32_t* digest)
+{
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    char spare[32];
+    int r = 0;
+
+    if (!_integrity || (page < 0) || (count < 0) || (page + count > _pages))
     {
-        _devicesize = 524288;
-        _pages = 2048;
-        _blocks = 256;
-        if (_status & 0x1)
+        return (-1); // something isnt configured right
+    }
+
+    ct.compute_partial_start(digest);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (read_spare(spare, page + i) != 0) // a few bytes per page instead of the whole page
         {
-            _pagesize = 256;
+            ct.compute_partial_stop(digest);
+            return (-1);
         }
-        else
+
+        if ((get_word(&spare[AT45_SPARE_CRC]) == 0xffffffff) && (get_word(&spare[AT45_SPARE_SEQ]) == 0xffffffff))
         {
-            _pagesize = 264;
+            r = AT45_CRC_MISMATCH; // the page was never programmed with a record
+        }
+
+        // programs after the scan are ordered after every page seen
+        uint32_t seq = get_word(&spare[AT45_SPARE_SEQ]);
+        if ((seq != 0xffffffff) && (seq >= _seq))
+        {
+            _seq = seq + 1;
         }
+
+        ct.compute_partial((void*)&spare[AT45_SPARE_CRC], 4, digest);
     }
-    else if ( (_id & 0x1f) == 0x5) // 8Mbits
+
+    ct.compute_partial_stop(digest);
+
+    return (r);
+}
+
+// Move the sequence number past the records of every page, reading only the spare bytes
+int AT45::_recoverseq()
+{
+    char spare[AT45_SEQ_SCAN_PAGES * 32];
+    int sparesize = _pagesize - _datasize;
+
+    _seq = 0;
+    _seqknown = false;
+
+    for (int page = 0; page < _pages; page += AT45_SEQ_SCAN_PAGES)
     {
-        _devicesize = 1048576;
-        _pages = 4096;
-        _blocks = 512;
-        if (_status & 0x1)
+        int count = (_pages - page < AT45_SEQ_SCAN_PAGES) ? (_pages - page) : AT45_SEQ_SCAN_PAGES;
+
+        if (read_spares(spare, page, count) != 0)
         {
-            _pagesize = 256;
+            return (-1);
         }
-        else
+
+        for (int i = 0; i < count; i++)
         {
-            _pagesize = 264;
+            uint32_t seq = get_word(&spare[i * sparesize + AT45_SPARE_SEQ]);
+            if ((seq != 0xffffffff) && (seq >= _seq))
+            {
+                _seq = seq + 1;
+            }
         }
     }
-    else if ( (_id & 0x1f) == 0x6) // 16Mbits
+
+    _seqknown = true;
+
+    return (0);
+}
+
+int AT45::write_block(char *data, int block)
+{
+    AT45_STAT_OP (program, 8 * _datasize);
+
+    if (block < _blocks || block == 0)
     {
-        _devicesize = 2097152;
-        _pages = 4096;
-        _blocks = 512;
-        if (_status & 0x1)
-        {
-            _pagesize = 512;
-        }
-        else
+        // pipelined over both SRAM buffers, straight from the caller's buffer
+        return (write_pages(data, block * 8, 8));
+    }
+    else
+    {
+        //do nothing
+    }
+
+    return (0);
+}
+
+int AT45::write_block(char *data[], int block)
+{
+    AT45_STAT_OP (program, 8 * _datasize);
+
+    if (block < _blocks || block == 0)
+    {
+        int page_start = block * 8;
+
+        for (int i=0; i<8 ;i++)
         {
-            _pagesize = 528;
+            // write_page alternates the SRAM buffers, each fill overlaps with the previous page program
+            int r = write_page(data[i], page_start + i);
+            if (r != 0)
+            {
+                return (r);
+            }
         }
     }
-    else if ( (_id & 0x1f) == 0x7) // 32Mbits
+    else
+    {
+        //do nothing
+    }
+
+    return (0);
+}
+
+int AT45::FAT_read(char* data, int page)
+{
+    AT45_STAT_OP (read, 512);
+
+    if (_pageshift < 0)
+    {
+        return (-1); // something isnt configured right
+    }
+
+    // 256 byte pages are read as two pages, 1024 byte pages as the right half of a page
+    int chunk = (_bytemask < 512) ? (_bytemask + 1) : 512;
+
+    for (int done = 0; done < 512; done += chunk)
+    {
+        int address = (page * 512) + done; // This is the start address in the 512 byte block
+
+        // skips the main memory to buffer transfer when a buffer already holds the page
+        int buffer = _loadbuffer(_getpaddr(address));
+
+        // this is done directly as we are reading back an entire buffer, and this can be done more optimally than using _sramread
+        _select();
+        _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, _getbaddr(address), 1); // opcode, buffer address and dont care byte
+        _readdata (&data[done], chunk);
+        _deselect();
+    }
+
+    return (0);
+}
+
+int AT45::FAT_write(char* data, int page)
+{
+    AT45_STAT_OP (program, 512);
+
+    if (_pageshift < 0)
+    {
+        return (-1); // something isnt configured right
+    }
+
+    // 256 byte pages are overwritten as two pages, 1024 byte pages get a read modify write of the right half
+    int chunk = (_bytemask < 512) ? (_bytemask + 1) : 512;
+
+    for (int done = 0; done < 512; done += chunk)
+    {
+        int address = (page * 512) + done; // This is the start address in the 512 byte block
+        int r;
+
+        if (chunk > _bytemask)
+        {
+            // the whole page is overwritten, fill the buffer that is not being programmed
+            int buffer = _fillbuffer();
+
+            // do this directly, for better performance
+            _bufferwrite (buffer, 0, &data[done], chunk);
+            _sealspare (buffer, &data[done]);
+            r = _program (buffer, _getpaddr(address), true);
+        }
+        else
+        {
+            r = _patch (_getpaddr(address), _getbaddr(address), &data[done], chunk, true);
+        }
+
+        if (r != 0)
+        {
+            return (r);
+        }
+    }
+
+    return (0);
+}
+
+// Erase the entire chip
+void AT45::chip_erase()
+{
+    AT45_STAT_OP (erase, _pages * _datasize);
+
+    _busy(); // make sure flash isnt already in busy.
+
+    _select();
+    // 4 byte command sequence
+    _spi->write(0xc7);
+    _spi->write(0x94);
+    _spi->write(0x80);
+    _spi->write(0x9a);
+    _deselect();
+    _expect (AT45_T_CE_US);
+    _invalidate (0, 0x7fffffff);
+
+    _busy(); // Make erase a blocking function
+}
+
+// Erase one block
+void AT45::block_erase(int block)
+{
+    AT45_STAT_OP (erase, 8 * _datasize);
+
+    // Calculate page addresses
+    if(block < _blocks || block == 0)
+    {
+        int address = _pageaddress(block * 8);
+
+        _busy();
+        _select();
+        _sendcmd (0x50, address);
+        _deselect();
+        _expect (AT45_T_BE_US); // the next command waits for the erase to complete
+        _invalidate (address, address + 8 * _pageaddress(1));
+    }
+    else
+    {
+        //do nothing
+    }
+}
+
+// Erase one page
+void AT45::page_erase(int page)
+{
+    AT45_STAT_OP (erase, _datasize);
+
+    // Calculate page addresses
+    if(page < _pages || page == 0)
+    {
+        int address = _pageaddress(page);
+
+        _busy();
+        _select();
+        _sendcmd (0x81, address);
+        _deselect();
+        _expect (AT45_T_PE_US); // the next command waits for the erase to complete
+        _invalidate (address, address + _pageaddress(1));
+    }
+    else
+    {
+        //do nothing
+    }
+}
+
+// Erase one sector, sector 0 is split in sector 0a (the first block) and sector 0b
+void AT45::sector_erase(int sector)
+{
+    AT45_STAT_OP (erase, _sectorpages * _datasize);
+
+    if(sector < _sectors || sector == 0)
+    {
+        int page = sector * _sectorpages;
+
+        _invalidate (_pageaddress(page), _pageaddress(page + _sectorpages));
+
+        _busy();
+        _select();
+        _sendcmd (0x7c, _pageaddress(page));
+        _deselect();
+        _expect (AT45_T_SE_US);
+
+        if (sector == 0) // erase sector 0b as well
+        {
+            _busy();
+            _select();
+            _sendcmd (0x7c, _pageaddress(8));
+            _deselect();
+            _expect (AT45_T_SE_US);
+        }
+    }
+    else
+    {
+        //do nothing
+    }
+}
+
+// Erase a range of pages with the largest erase units that fit
+int AT45::erase_pages(int page, int count)
+{
+    AT45_STAT_OP (erase, count * _datasize);
+
+    if ((page < 0) || (count < 0) || (page + count > _pages))
+    {
+        return (-1);
+    }
+
+    int end = page + count;
+
+    while (page < end)
+    {
+        page += _erasestep (page, end);
+    }
+
+    return (0);
+}
+
+int AT45::wipe(int page, int count, at45_progress_t progress)
+{
+    AT45_STAT_OP (erase, count * _datasize);
+
+    if ((page < 0) || (count < 0) || (page + count > _pages))
+    {
+        return (-1);
+    }
+
+    int start = page;
+    int end = page + count;
+
+    while (page < end)
+    {
+        page += _erasestep (page, end); // waits for the erase before it
+
+        // runs while the erase it reports is in progress
+        if (progress && !progress(page - start, count))
+        {
+            _busy();
+            return (AT45_WIPE_CANCELLED);
+        }
+    }
+
+    _busy(); // Make wipe a blocking function
+
+    return (0);
+}
+
+int AT45::wipe_start(int page, int count)
+{
+    if ((page < 0) || (count < 0) || (page + count > _pages))
+    {
+        return (-1);
+    }
+
+    _wipe_start = page;
+    _wipe_page = page;
+    _wipe_end = page + count;
+
+    return (0);
+}
+
+int AT45::wipe_poll(int* done)
+{
+    int r = 0;
+
+    if (is_busy())
+    {
+        r = 1; // the erase before it is still running
+    }
+    else if (_wipe_page < _wipe_end)
+    {
+        _wipe_page += _erasestep (_wipe_page, _wipe_end);
+        r = 1;
+    }
+
+    if (done != NULL)
+    {
+        *done = _wipe_page - _wipe_start;
+    }
+
+    return (r);
+}
+
+void AT45::wipe_cancel()
+{
+    _wipe_end = _wipe_page;
+}
+
+// Issue the largest aligned erase starting at a page, returns the pages it covers
+int AT45::_erasestep(int page, int end)
+{
+    if ((page == 0) && (_sectorpages <= end))
+    {
+        // sector 0a, sector 0b takes an erase of its own so every erase is one command
+        block_erase(0);
+        return (8);
+    }
+
+    if ((page == 8) && (_sectorpages <= end))
+    {
+        AT45_STAT_OP (erase, (_sectorpages - 8) * _datasize);
+
+        _invalidate (_pageaddress(8), _pageaddress(_sectorpages));
+
+        _busy();
+        _select();
+        _sendcmd (0x7c, _pageaddress(8)); // sector 0b
+        _deselect();
+        _expect (AT45_T_SE_US);
+
+        return (_sectorpages - 8);
+    }
+
+    if (((page % _sectorpages) == 0) && (page + _sectorpages <= end))
+    {
+        sector_erase(page / _sectorpages);
+        return (_sectorpages);
+    }
+
+    if (((page % 8) == 0) && (page + 8 <= end))
+    {
+        block_erase(page / 8);
+        return (8);
+    }
+
+    page_erase(page);
+    return (1);
+}
+
+// return the size of the part in bytes
+int AT45::device_size()
+{
+    return _devicesize;
+}
+
+// return the numbers of pages
+int AT45::pages()
+{
+    return _pages;
+}
+
+// return the page size of the part in bytes
+int AT45::pagesize()
+{
+    return _datasize;
+}
+
+// Return the number of spare bytes per page in the binary view
+int AT45::sparesize()
+{
+    return _pagesize - _datasize;
+}
+
+// Page size configuration of the device, status register bit 0
+bool AT45::is_binary()
+{
+    return ((status() & 0x1) != 0);
+}
+
+// Expose only the binary part of non-2^N pages through the page functions
+int AT45::set_binary_view(bool onoff)
+{
+    if (_pageshift < 0)
+    {
+        return (-1); // something isnt configured right
+    }
+
+    _datasize = onoff ? (_bytemask + 1) : _pagesize;
+
+    return (0);
+}
+
+// A one-time programmable configuration
+void AT45::set_pageszie_to_binary()
+{
+    _busy(); // make sure flash isnt already in busy.
+
+    _select();
+    // 4 byte command sequence
+    _spi->write(0x3d);
+    _spi->write(0x2a);
+    _spi->write(0x80);
+    _spi->write(0xa6);
+    _deselect();
+    _expect (AT45_T_EP_US);
+    _invalidate (0, 0x7fffffff); // the page addressing changes
+
+    _busy(); // Make erase a blocking function
+}
+
+// Return the number of blocks in this device in accordance with the datasheet
+int AT45::blocks()
+{
+    return _blocks;
+}
+
+// Return the number of sectors in this device in accordance with the datasheet
+int AT45::sectors()
+{
+    return _sectors;
+}
+
+// Return the Id of the part
+int AT45::id()
+{
+    int id = 0;
+    _select();
+    _spi->write(0x9f);
+    id = (_spi->write(0x00) << 8);
+    id |= _spi->write(0x00);
+    _deselect();
+    return id;
+}
+
+// Write a test pattern into an SRAM buffer and read it back
+int AT45::bus_test()
+{
+    static const uint8_t pattern[16] = {
+        0x55, 0xaa, 0x00, 0xff, 0x33, 0xcc, 0x0f, 0xf0,
+        0x01, 0x80, 0x7e, 0x81, 0x5a, 0xa5, 0xc3, 0x3c
+    };
+    char data[sizeof(pattern)];
+
+    int buffer = _fillbuffer();
+
+    _bufferwrite(buffer, 0, (const char*)pattern, sizeof(pattern));
+
+    _select();
+    _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, 0, 1); // opcode, address and dont care byte
+    _readdata (data, sizeof(data));
+    _deselect();
+
+    return (memcmp(data, pattern, sizeof(pattern)) == 0) ? 0 : -1;
+}
+
+// return the Status
+int AT45::status()
+{
+#if AT45_STATS_ENABLED
+    uint32_t start = us_ticker_read();
+#endif
+    int status = 0;
+    _select();
+    _spi->write(0xd7);
+    status = (_spi->write(0x00));
+    _deselect();
+#if AT45_STATS_ENABLED
+    _record (&_stats.status, 1, us_ticker_read() - start);
+#endif
+    return status;
+}
+
+void AT45::get_stats(at45_stats_t* stats)
+{
+    *stats = _stats;
+}
+
+void AT45::reset_stats()
+{
+    memset (&_stats, 0, sizeof(_stats));
+}
+
+// Upper bound of the histogram bucket that holds the given percentile
+uint32_t AT45::stats_percentile(const at45_op_stats_t* op, int percent)
+{
+    uint32_t target = ((uint64_t)op->count * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    if (op->count == 0)
+    {
+        return (0);
+    }
+
+    for (int bucket = 0; bucket < AT45_STATS_BUCKETS; bucket++)
+    {
+        seen += op->histogram[bucket];
+        if (seen >= target)
+        {
+            return ((bucket < AT45_STATS_BUCKETS - 1) ? ((1u << bucket) - 1) : op->max_us);
+        }
+    }
+
+    return (op->max_us);
+}
+
+// Make sure the Flash isnt already doing something
+void AT45::busy()
+{
+    _busy();
+}
+
+bool AT45::is_busy()
+{
+    if (!_inflight)
+    {
+        return (false);
+    }
+
+    if ((_remaining_us() > 0) || !(status() & 0x80))
+    {
+        return (true);
+    }
+
+    _inflight = false;
+    return (false);
+}
+
+void AT45::deep_power_down(bool _deep_down_onoff)
+{
+    if(_deep_down_onoff == true) // Go to deep power down
+    {
+        power_down(POWER_DOWN_DEEP);
+    }
+    else if(_asleep) // Wake up from deep power down
+    {
+        wake();
+    }
+    else
+    {
+        _release(AT45_T_XUDPD_US); // a previous owner may have left the device powered down
+    }
+}
+
+void AT45::power_down(PowerDown mode)
+{
+    if (_asleep)
+    {
+        return;
+    }
+
+    _busy(); // make sure flash isnt already in busy.
+
+    _select();
+    _spi->write((mode == POWER_DOWN_ULTRA_DEEP) ? 0x79 : 0xb9);
+    _deselect();
+
+    _asleep = true;
+    _sleep_mode = mode;
+
+    if (mode == POWER_DOWN_ULTRA_DEEP)
+    {
+        _invalidate (0, 0x7fffffff); // the SRAM buffers are not retained
+    }
+
+#if AT45_STATS_ENABLED
+    _stats.sleeps++;
+    _sleep_start = ticker_read_us(get_us_ticker_data());
+#endif
+}
+
+void AT45::wake()
+{
+    if (!_asleep)
+    {
+        return;
+    }
+
+    _release((_sleep_mode == POWER_DOWN_ULTRA_DEEP) ? AT45_T_XUDPD_US : AT45_T_RDPD_US);
+    _asleep = false;
+
+#if AT45_STATS_ENABLED
+    _stats.wakes++;
+    _stats.asleep_us += ticker_read_us(get_us_ticker_data()) - _sleep_start;
+#endif
+}
+
+bool AT45::is_it_awake()
+{
+    return !_asleep;
+}
+
+bool AT45::is_buffered(int page)
+{
+    return (_buffered(_pageaddress(page)) != 0);
+}
+
+int AT45::validate_buffers()
+{
+    int valid = 0;
+
+    for (int buffer = 1; buffer <= 2; buffer++)
+    {
+        int paddr = _bufpaddr[buffer - 1];
+
+        if (paddr < 0)
+        {
+            continue;
+        }
+
+        if (_compare(buffer, paddr) == 0)
+        {
+            valid++;
+        }
+    }
+
+    return (valid);
+}
+
+int AT45::set_wait_mode(WaitMode mode, PinName rdybsy)
+{
+    if (mode == WAIT_IRQ)
+    {
+#if MBED_CONF_RTOS_PRESENT
+        if (rdybsy == NC)
+        {
+            return (-1); // need the RDY/BUSY pin to wait on
+        }
+
+        _freeirq(); // the pin may differ from the previous call
+
+        _ready = new Semaphore(0);
+        _rdybsy = new InterruptIn(rdybsy);
+        _rdybsy->rise(callback(this, &AT45::_ready_irq));
+#else
+        return (-1); // nothing to sleep on without the RTOS
+#endif
+    }
+
+    _wait_mode = mode;
+
+    return (0);
+}
+
+#if DEVICE_SPI_ASYNCH
+int AT45::read_page_async(char* data, int page, const event_callback_t& callback)
+{
+    int address = _pageaddress(page);
+
+    if (address < 0 || _async_state != AT45_ASYNC_IDLE)
+    {
+        return (-1);
+    }
+
+    int buffer = _loadbuffer(address);
+
+    _async_callback = callback;
+    _async_state = AT45_ASYNC_READ;
+
+    // header goes out synchronously, the payload is clocked in by the asynch transfer
+    _awake();
+    _ncs = 0; // not _select, chip select is released from interrupt context
+    _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, 0x0, 1);
+
+    if (_spi->transfer((const char*)NULL, 0, data, _datasize, mbed::callback(this, &AT45::_async_handler), SPI_EVENT_ALL) != 0)
+    {
+        _ncs = 1;
+        _async_state = AT45_ASYNC_IDLE;
+        return (-1);
+    }
+
+    return (0);
+}
+
+int AT45::write_page_async(const char* data, int page, const event_callback_t& callback)
+{
+    int address = _pageaddress(page);
+
+    if (address < 0 || _async_state != AT45_ASYNC_IDLE)
+    {
+        return (-1);
+    }
+
+    _busy(); // the program command is issued from interrupt context, so the flash must be idle now
+
+    int buffer = _fillbuffer();
+
+    // program command that follows the buffer fill
+    _async_header[0] = (buffer == 1) ? 0x83 : 0x86;
+    _async_header[1] = address >> 16;
+    _async_header[2] = address >> 8;
+    _async_header[3] = address;
+
+    _sealspare (buffer, data); // synchronous, only the page data goes through the asynch transfer
+
+    _async_callback = callback;
+    _async_state = AT45_ASYNC_WRITE_FILL;
+
+    _program_buffer = buffer;
+    _mirror (buffer, -1); // becomes a copy of the page once the program command is out
+
+    _awake();
+    _ncs = 0; // not _select, chip select is released from interrupt context
+    _sendcmd ((buffer == 1) ? 0x84 : 0x87, 0); // writing the entire buffer
+
+    if (_spi->transfer(data, _datasize, (char*)NULL, 0, mbed::callback(this, &AT45::_async_handler), SPI_EVENT_ALL) != 0)
+    {
+        _ncs = 1;
+        _async_state = AT45_ASYNC_IDLE;
+        return (-1);
+    }
+
+    return (0);
+}
+
+bool AT45::is_async_busy()
+{
+    return (_async_state != AT45_ASYNC_IDLE);
+}
+#endif
+
+int AT45::stream_open(int page, int offset)
+{
+    int address = _pageaddress(page);
+
+    if ((address < 0) || (page >= _pages) || (offset < 0) || (offset >= _pagesize))
+    {
+        return (-1); // something isnt configured right
+    }
+
+    _busy(); // the array has to be idle for a main memory read
+
+    _select(); // held until stream_close
+    _sendcmd (0x0b, address | offset, 1); // opcode, address and dont care byte
+
+    return (0);
+}
+
+void AT45::stream_read(char* data, int length)
+{
+    _readdata (data, length);
+}
+
+#if DEVICE_SPI_ASYNCH
+int AT45::stream_read_async(char* data, int length, const event_callback_t& callback)
+{
+    return (_spi->transfer((const char*)NULL, 0, data, length, callback, SPI_EVENT_ALL) == 0) ? 0 : -1;
+}
+#endif
+
+void AT45::stream_close()
+{
+    _deselect();
+}
+
+//=============================================================================
+// Private functions
+//=============================================================================
+
+// State before the device has been talked to
+void AT45::_defaults()
+{
+    _pages = -1;        // number of pages
+    _pagesize = -1;     // size of pages 256/264, 512/528, 1024/1056
+    _devicesize = -1;   // In bytes
+    _asleep = false;          // assumed awake, deep_power_down(false) wakes a device left powered down
+    _sleep_mode = POWER_DOWN_DEEP;
+    _wake_start = 0;
+    _wake_us = 0;
+    _sleep_start = 0;
+    _program_buffer = 2;      // SRAM buffer used by the last page program, the next write_page fills buffer 1
+    _reserved = 0;            // no SRAM buffer is held by buffer_reserve
+    _bufpaddr[0] = -1;        // the SRAM buffers hold no known page
+    _bufpaddr[1] = -1;
+    _wait_mode = WAIT_POLL;   // spin on the status register until told otherwise
+    _integrity = false;       // spare bytes are left erased
+    _opdepth = 0;
+    memset (&_stats, 0, sizeof(_stats));
+    _verify = false;          // page programs are not compared
+    _seq = 0;
+    _seqknown = false;
+    _erasedcrc = 0;
+    _inflight = false;
+    _wipe_start = 0;
+    _wipe_page = 0;
+    _wipe_end = 0;
+    _rdybsy = NULL;
+#if MBED_CONF_RTOS_PRESENT
+    _ready = NULL;
+#endif
+#if DEVICE_SPI_ASYNCH
+    _async_state = AT45_ASYNC_IDLE;
+#endif
+}
+
+void AT45::_initialize()
+{
+    _geometry(id(), status());
+}
+
+// Resolve the geometry from the ID and the status register
+void AT45::_geometry(int _id, int _status)
+{
+    if ((_id & 0x1f) == 0x3)  // 2Mbits
+    {
+        _devicesize = 262144; // Size in bytes
+        _pages = 1024;        // Number of pages
+        _blocks = 128;        // Number of blocks
+        _sectorpages = 128;   // Pages per sector, sector 0 is split in 0a and 0b
+        if (_status & 0x1)
+        {
+            _pagesize = 256;
+        }
+        else
+        {
+            _pagesize = 264;
+        }
+    }
+    else if ( (_id & 0x1f) == 0x4) // 4Mbits
+    {
+        _devicesize = 524288;
+        _pages = 2048;
+        _blocks = 256;
+        _sectorpages = 256;
+        if (_status & 0x1)
+        {
+            _pagesize = 256;
+        }
+        else
+        {
+            _pagesize = 264;
+        }
+    }
+    else if ( (_id & 0x1f) == 0x5) // 8Mbits
+    {
+        _devicesize = 1048576;
+        _pages = 4096;
+        _blocks = 512;
+        _sectorpages = 256;
+        if (_status & 0x1)
+        {
+            _pagesize = 256;
+        }
+        else
+        {
+            _pagesize = 264;
+        }
+    }
+    else if ( (_id & 0x1f) == 0x6) // 16Mbits
+    {
+        _devicesize = 2097152;
+        _pages = 4096;
+        _blocks = 512;
+        _sectorpages = 256;
+        if (_status & 0x1)
+        {
+            _pagesize = 512;
+        }
+        else
+        {
+            _pagesize = 528;
+        }
+    }
+    else if ( (_id & 0x1f) == 0x7) // 32Mbits
+    {
+        _devicesize = 4194304;
+        _pages = 8192;
+        _blocks = 1024;
+        _sectorpages = 128;
+        if (_status & 0x1)
+        {
+            _pagesize = 512;
+        }
+        else
+        {
+            _pagesize = 528;
+        }
+    }
+    else if ( (_id & 0x1f) == 0x8) // 64Mbits
+    {
+        _devicesize = 8388608;
+        _pages = 8192;
+        _blocks = 1024;
+        _sectorpages = 256;
+        if (_status & 0x1)
+        {
+            _pagesize = 1024;
+        }
+        else
+        {
+            _pagesize = 1056;
+        }
+    }
+    else
+    {
+        _devicesize = -1;
+        _pages = -1;
+        _pagesize = -1;
+        _blocks = -1;
+        _sectorpages = -1;
+    }
+
+    _sectors = (_sectorpages > 0) ? (_pages / _sectorpages) : -1;
+    _datasize = _pagesize; // all of the page, until a binary view is selected
+
+    // Resolve the address geometry once, addresses are a shift and an OR from here on
+    if (_pagesize > 0)
+    {
+        // 8/9/10 byte address bits, the binary page size 256/512/1024
+        for (_byteshift = 8; (2 << _byteshift) <= _pagesize; _byteshift++);
+        _bytemask = (1 << _byteshift) - 1;
+
+        // non-2^N pages need one more byte address bit, the page number starts above it
+        _pageshift = (_pagesize & (_pagesize - 1)) ? (_byteshift + 1) : _byteshift;
+    }
+    else
+    {
+        _byteshift = -1;
+        _bytemask = 0;
+        _pageshift = -1;
+    }
+}
+
+// Chip select holds the SPI bus lock, so the bytes of a command are never interleaved with another thread's
+void AT45::_select()
+{
+    _awake();
+
+#if AT45_STATS_ENABLED
+    uint32_t start = us_ticker_read();
+    _spi->lock();
+    uint32_t waited = us_ticker_read() - start;
+    if (waited > 0)
+    {
+        _stats.lock_waits++;
+        _stats.lock_us += waited;
+    }
+#else
+    _spi->lock();
+#endif
+    _ncs = 0;
+}
+
+// Wake the device if it is powered down, and wait for what is left of its wake up time
+void AT45::_awake()
+{
+    if (_asleep)
+    {
+        wake();
+    }
+
+    if (_wake_us)
+    {
+        while ((int)(us_ticker_read() - _wake_start) < _wake_us);
+        _wake_us = 0;
+    }
+}
+
+// Release from (ultra-)deep power down, 0xab wakes from deep power down and the chip select pulse
+// alone from ultra-deep power down, the device takes the given time to get there
+void AT45::_release(int us)
+{
+    _spi->lock();
+    _ncs = 0;
+    _spi->write(0xab);
+    _ncs = 1;
+    _spi->unlock();
+
+    _wake_start = us_ticker_read();
+    _wake_us = us;
+}
+
+void AT45::_deselect()
+{
+    _ncs = 1;
+    _spi->unlock();
+}
+
+void AT45::_busy() {
+    if (!_inflight)
+    {
+        return; // nothing has been issued that keeps the device busy
+    }
+
+    int remaining = _remaining_us();
+
+#if AT45_STATS_ENABLED
+    uint32_t start = us_ticker_read();
+    uint32_t polls = _stats.status.count;
+#endif
+
+    if (_wait_mode == WAIT_CONTINUOUS)
+    {
+        // one status read command, keep clocking status bytes until bit 7 is set
+        _select(); // holds the bus for the whole chip select window
+        _spi->write(0xd7);
+        while (!(_spi->write(0x00) & 0x80)) {
+#if AT45_STATS_ENABLED
+            _stats.busy_polls++;
+#endif
+        }
+        _deselect();
+    }
+    else if (_wait_mode == WAIT_SLEEP)
+    {
+        // sleep until the typical end of the operation, then poll at a fraction of its duration
+        int interval = _busy_us / 10;
+        if (interval < AT45_POLL_MIN_US) {
+            interval = AT45_POLL_MIN_US;}
+        else if (interval > AT45_POLL_MAX_US) {
+            interval = AT45_POLL_MAX_US;}
+
+        if (remaining > 0) {
+            _sleep(remaining);}
+
+        while (!(status() & 0x80)) {
+            _sleep(interval);
+        }
+    }
+#if MBED_CONF_RTOS_PRESENT
+    else if (_wait_mode == WAIT_IRQ)
+    {
+        // RDY/BUSY is low while busy, the rising edge releases the semaphore
+        while (!_rdybsy->read()) {
+            _ready->wait(remaining / 1000 + 1);
+        }
+    }
+#endif
+    else
+    {
+        volatile int iambusy = 1;
+        while (iambusy) {
+            // if bit 7 is set, we can proceed
+            if ( status() & 0x80 ) {
+                iambusy = 0;}
+        }
+    }
+
+#if AT45_STATS_ENABLED
+    _stats.busy_waits++;
+    _stats.busy_polls += _stats.status.count - polls;
+    _stats.busy_us += us_ticker_read() - start;
+#endif
+
+    _inflight = false;
+}
+
+// Track the operation that was just issued, the device is busy until its typical duration has elapsed
+void AT45::_expect(int us)
+{
+    _busy_start = us_ticker_read();
+    _busy_us = us;
+    _inflight = true;
+}
+
+// Time left until the operation in flight typically completes
+int AT45::_remaining_us()
+{
+    int elapsed = (int)(us_ticker_read() - _busy_start);
+
+    return (elapsed < _busy_us) ? (_busy_us - elapsed) : 0;
+}
+
+// Let other threads run for a while, wait_us spins without yielding
+void AT45::_sleep(int us)
+{
+#if MBED_CONF_RTOS_PRESENT
+    if (us >= 1000)
+    {
+        ThisThread::sleep_for(us / 1000);
+        us %= 1000;
+    }
+#endif
+
+    if (us > 0)
+    {
+        wait_us(us);
+    }
+}
+
+#if MBED_CONF_RTOS_PRESENT
+// RDY/BUSY rising edge, the device is ready
+void AT45::_ready_irq()
+{
+    _ready->release();
+}
+#endif
+
+// Detach and free the RDY/BUSY interrupt and its semaphore
+void AT45::_freeirq()
+{
+    if (_rdybsy)
+    {
+        _rdybsy->rise(NULL);
+        delete _rdybsy;
+        _rdybsy = NULL;
+    }
+
+#if MBED_CONF_RTOS_PRESENT
+    delete _ready;
+    _ready = NULL;
+#endif
+}
+
+// Write to an SRAM buffer
+// Note : We create buffer and page addresses in _sram and _flash
+void AT45::_sramwrite(int buffer, int address, int data)
+{
+
+    int cmd = 0;
+    int baddr = 0;
+
+    baddr = _getbaddr(address);
+
+    _busy();
+
+    _mirror (buffer, -1); // the buffer no longer matches a main memory page
+
+    _select();
+
+    if (buffer == 1)
+        {cmd = 0x84;}
+    else
+        {cmd = 0x87;}
+
+    _sendcmd (cmd, baddr);
+    _spi->write (data);
+
+    _deselect();
+}
+
+// Read from an SRAM buffer
+// Note : We create buffer and page addresses in _sram and _flash
+int AT45::_sramread(int buffer, int address)
+{
+
+    int cmd = 0;
+    int baddr = 0;
+    int bufdata = 0;
+
+    baddr = _getbaddr(address);
+
+    _select();
+
+    if(buffer == 1)
+        {cmd = 0xd4;}
+    else
+        {cmd = 0xd6;}
+
+    _sendcmd (cmd, baddr, 1); // with dont care byte
+    bufdata = _spi->write (0x0);
+
+    _deselect();
+
+    return (bufdata);
+}
+
+// Write and SRAM buffer to main memory
+void AT45::_flashwrite (int buffer, int address)
+{
+
+    int cmd = 0;
+    int paddr = _getpaddr(address);
+
+    _busy();  // Check flash is not busy
+
+    _select();
+
+    if (buffer == 1)
+        {cmd = 0x83;}
+    else
+        {cmd = 0x86;}
+
+    _sendcmd (cmd, paddr);
+    _deselect();
+    _expect (AT45_T_EP_US);
+
+    _program_buffer = buffer;
+    _mirror (buffer, paddr);
+
+    _busy();  // Check flash is not busy
+}
+
+// Read from Flash memory into SRAM buffer
+void AT45::_flashread (int buffer, int address)
+{
+
+    int cmd = 0;
+    int paddr = _getpaddr(address); // calculate page address
+
+    _busy();  // Check flash is not busy
+    _select();
+
+    if (buffer == 1)
+        {cmd = 0x53;}
+    else
+        {cmd = 0x55;}
+
+    _sendcmd (cmd, paddr);
+    _deselect();
+    _expect (AT45_T_XFR_US);
+
+    _bufpaddr[buffer - 1] = paddr;
+}
+
+// Read directly from main memory
+int AT45::_memread (int address)
+{
+
+    int data = 0;
+    int addr;
+
+    addr = _getpaddr(address) | _getbaddr(address);
+
+    // serve the byte from a buffer holding the page, unless it may still be programming from it
+    int buffer = _buffered(_getpaddr(address));
+    if ((buffer != 0) && ((buffer != _program_buffer) || !_inflight))
+    {
+        return _sramread(buffer, address);
+    }
+
+    _busy();
+
+    _select();
+
+    // continuous read rather than the direct page read (0xd2), 0xd2 and 0x03 are
+    // specified to a lower clock than the other commands
+    _sendcmd (0x0b, addr, 1);  // opcode, address and dont care byte
+
+    // this one clocks the data
+    data = _spi->write (0x00);
+    _deselect();
+
+    return data;
+}
+
+// Program an SRAM buffer into a page, with built-in erase (0x83/0x86) or into an already erased page (0x88/0x89)
+int AT45::_program(int buffer, int paddr, bool erase)
+{
+    _busy(); // make sure the previous page program has finished
+
+    _select();
+    if (erase)
+    {
+        _sendcmd ((buffer == 1) ? 0x83 : 0x86, paddr);
+    }
+    else
+    {
+        _sendcmd ((buffer == 1) ? 0x88 : 0x89, paddr);
+    }
+    _deselect();
+    _expect (erase ? AT45_T_EP_US : AT45_T_P_US);
+
+    _program_buffer = buffer;
+    _mirror (buffer, paddr); // the buffer now holds a copy of the page
+
+    return (_verified (buffer, paddr));
+}
+
+// With program verify, wait for the page program and compare the page against the buffer it came from
+int AT45::_verified(int buffer, int paddr)
+{
+    if (!_verify)
+    {
+        return (0);
+    }
+
+    _busy(); // the page program has to finish before the compare
+
+    return (_compare (buffer, paddr));
+}
+
+// Main Memory Page to Buffer Compare, the buffer no longer mirrors the page when they differ
+int AT45::_compare(int buffer, int paddr)
+{
+    _busy();
+    _select();
+    _sendcmd ((buffer == 1) ? 0x60 : 0x61, paddr);
+    _deselect();
+    _expect (AT45_T_XFR_US);
+    _busy();
+
+    if (status() & 0x40) // bit 6 is set when the page and the buffer differ
+    {
+        _bufpaddr[buffer - 1] = -1;
+        return (AT45_VERIFY_MISMATCH);
+    }
+
+    _bufpaddr[buffer - 1] = paddr;
+    return (0);
+}
+
+// Make one of the SRAM buffers hold a copy of a main memory page, returns the buffer
+int AT45::_loadbuffer(int paddr)
+{
+    int buffer = _buffered(paddr);
+
+    if (buffer == 0)
+    {
+        // use the buffer that is not being programmed, so the last programmed page stays mirrored
+        buffer = _fillbuffer();
+
+        _busy();
+        _select();
+        _sendcmd ((buffer == 1) ? 0x53 : 0x55, paddr);
+        _deselect();
+        _expect (AT45_T_XFR_US);
+        _bufpaddr[buffer - 1] = paddr;
+
+        _busy(); // Wait until the page has loaded into the buffer
+    }
+    else if (buffer == _program_buffer)
+    {
+        _busy(); // the page may still be programming from this buffer
+    }
+
+    return (buffer);
+}
+
+// Read-modify-write of part of a page, skips the page transfer when a buffer already holds the page
+int AT45::_patch(int paddr, int offset, const char* data, int length, bool erase)
+{
+    int buffer = _loadbuffer(paddr);
+
+    if (_integrity)
+    {
+        // the record in the spare bytes covers the whole page, seal the patched buffer
+        _bufferwrite (buffer, offset, data, length);
+        _sealspare (buffer, NULL);
+        return (_program (buffer, paddr, erase));
+    }
+    else if (erase)
+    {
+        _busy(); // make sure the array is idle
+
+        // Main Memory Page Program through Buffer, patches the buffer and
+        // programs it with built-in erase when chip select goes high
+        _bufpaddr[buffer - 1] = -1;
+        _select();
+        _sendcmd ((buffer == 1) ? 0x82 : 0x85, paddr | offset);
+        _writedata (data, length);
+        _deselect();
+        _expect (AT45_T_EP_US);
+
+        _program_buffer = buffer;
+        _mirror (buffer, paddr);
+
+        return (_verified (buffer, paddr));
+    }
+
+    _bufferwrite (buffer, offset, data, length);
+    return (_program (buffer, paddr, false));
+}
+
+// Fill the spare bytes of an SRAM buffer, the binary view never programs stale spare bytes
+// With integrity checks the CRC of the page data (data, or the buffer contents when NULL) and a sequence number go in, otherwise the erased value
+void AT45::_sealspare(int buffer, const char* data)
+{
+    if (_datasize == _pagesize)
     {
-        _devicesize = 4194304;
-        _pages = 8192;
-        _blocks = 1024;
-        if (_status & 0x1)
-        {
-            _pagesize = 512;
-        }
-        else
-        {
-            _pagesize = 528;
-        }
+        return;
     }
-    else if ( (_id & 0x1f) == 0x8) // 64Mbits
+
+    if (_integrity)
     {
-        _devicesize = 8388608;
-        _pages = 8192;
-        _blocks = 1024;
-        if (_status & 0x1)
-        {
-            _pagesize = 1024;
-        }
-        else
-        {
-            _pagesize = 1056;
-        }
+        _sealrecord (buffer, (data != NULL) ? _crc(data, _datasize) : _buffercrc(buffer));
     }
     else
     {
-        _devicesize = -1;
-        _pages = -1;
-        _pagesize = -1;
-        _blocks = -1;
+        _sealrecord (buffer, 0);
     }
 }
 
-void AT45::_select()
+// Fill the spare bytes of an SRAM buffer with the record for a page data CRC, or the erased value without integrity checks
+void AT45::_sealrecord(int buffer, uint32_t crc)
 {
-    _ncs = 0;
+    char spare[32]; // the largest spare area, 1056 byte pages
+
+    if (_datasize == _pagesize)
+    {
+        return;
+    }
+
+    memset (spare, 0xff, sizeof(spare));
+
+    if (_integrity)
+    {
+        if (!_seqknown)
+        {
+            _recoverseq(); // cannot fail with the binary view, only reads main memory, not the SRAM buffers
+        }
+
+        put_word (&spare[AT45_SPARE_CRC], crc);
+        put_word (&spare[AT45_SPARE_SEQ], _seq++);
+    }
+
+    _bufferwrite (buffer, _datasize, spare, _pagesize - _datasize);
 }
 
-void AT45::_deselect()
+// Check the integrity record read from the spare bytes against the page data
+int AT45::_checkspare(const char* spare, const char* data)
 {
-    _ncs = 1;
+    return (_checkrecord(spare, _crc(data, _datasize)));
 }
 
-void AT45::_busy() {
-    volatile int iambusy = 1;
-    while (iambusy) {
-        // if bit 7 is set, we can proceed
-        if ( status() & 0x80 ) {
-            iambusy = 0;}
+// Check the integrity record read from the spare bytes against the CRC of the page data
+int AT45::_checkrecord(const char* spare, uint32_t crc)
+{
+    if (crc == get_word(&spare[AT45_SPARE_CRC]))
+    {
+        return (0);
+    }
+
+    // an erased page carries no record
+    if ((get_word(&spare[AT45_SPARE_CRC]) == 0xffffffff) && (get_word(&spare[AT45_SPARE_SEQ]) == 0xffffffff)
+        && (crc == _erasedcrc))
+    {
+        return (0);
     }
+
+    return (AT45_CRC_MISMATCH);
 }
 
-// Write to an SRAM buffer
-// Note : We create buffer and page addresses in _sram and _flash
-void AT45::_sramwrite(int buffer, int address, int data)
+// CRC32 of page data in RAM
+uint32_t AT45::_crc(const char* data, int length)
 {
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
 
-    int cmd = 0;
-    int baddr = 0;
+    ct.compute((void*)data, length, &crc);
 
-    baddr = _getbaddr(address);
+    return (crc);
+}
 
-    _busy();
+// CRC32 of the next length bytes of a segment list, starting at segment seg, byte skip
+uint32_t AT45::_crcv(const at45_iovec_t* iov, int seg, int skip, int length)
+{
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
 
-    _select();
+    ct.compute_partial_start(&crc);
 
-    if (buffer == 1)
-        {cmd = 0x84;}
-    else
-        {cmd = 0x87;}
+    while (length > 0)
+    {
+        int n = iov[seg].length - skip;
 
-    _spi->write(cmd);
-    _sendaddr (baddr);
-    _spi->write (data);
+        if (n > length)
+        {
+            n = length;
+        }
 
-    _deselect();
+        ct.compute_partial((char*)iov[seg].base + skip, n, &crc);
+
+        length -= n;
+        seg++;
+        skip = 0;
+    }
+
+    ct.compute_partial_stop(&crc);
+
+    return (crc);
 }
 
-// Read from an SRAM buffer
-// Note : We create buffer and page addresses in _sram and _flash
-int AT45::_sramread(int buffer, int address)
+// CRC32 of the page data held by an SRAM buffer, read back in small chunks
+uint32_t AT45::_buffercrc(int buffer)
 {
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
+    char chunk[64];
 
-    int cmd = 0;
-    int baddr = 0;
-    int bufdata = 0;
+    if (buffer == _program_buffer)
+    {
+        _busy(); // the buffer may still be programming into the array
+    }
 
-    baddr = _getbaddr(address);
+    ct.compute_partial_start(&crc);
 
     _select();
+    _sendcmd ((buffer == 1) ? 0xd4 : 0xd6, 0x0, 1); // opcode, buffer address and dont care byte
+    for (int done = 0; done < _datasize; done += sizeof(chunk))
+    {
+        _readdata (chunk, sizeof(chunk)); // the binary part is a multiple of 64 bytes
+        ct.compute_partial((void*)chunk, sizeof(chunk), &crc);
+    }
+    _deselect();
 
-    if(buffer == 1)
-        {cmd = 0xd4;}
-    else
-        {cmd = 0xd6;}
+    ct.compute_partial_stop(&crc);
 
-    _spi->write(cmd);
-    _sendaddr (baddr);
-    _spi->write (0x0);   // dont care byte
-    bufdata = _spi->write (0x0);
+    return (crc);
+}
 
-    _deselect();
+// Total length of a segment list, -1 for a bad list
+int AT45::_iovlength(const at45_iovec_t* iov, int count)
+{
+    int length = 0;
 
-    return (bufdata);
+    for (int i = 0; i < count; i++)
+    {
+        if (iov[i].length < 0)
+        {
+            return (-1);
+        }
+
+        length += iov[i].length;
+    }
+
+    return (length);
 }
 
-// Write and SRAM buffer to main memory
-void AT45::_flashwrite (int buffer, int address)
+#if AT45_STATS_ENABLED
+// Add one operation to the counters of its type
+void AT45::_record(at45_op_stats_t* op, int bytes, uint32_t us)
 {
+    int bucket = 0;
 
-    int cmd = 0;
-    int paddr = _getpaddr(address);
-
-    _busy();  // Check flash is not busy
+    while ((bucket < AT45_STATS_BUCKETS - 1) && (us >> bucket))
+    {
+        bucket++; // bucket n holds 2^(n-1) to 2^n - 1 us
+    }
 
-    _select();
+    op->count++;
+    op->bytes += bytes;
+    op->total_us += us;
+    if (us > op->max_us)
+    {
+        op->max_us = us;
+    }
+    op->histogram[bucket]++;
+}
 
-    if (buffer == 1)
-        {cmd = 0x83;}
-    else
-        {cmd = 0x86;}
+AT45::OpTimer::OpTimer(AT45* at45, at45_op_stats_t* op, int bytes)
+    : _at45(at45), _op(NULL), _bytes(bytes), _start(0)
+{
+    if (_at45->_opdepth++ == 0)
+    {
+        _op = op;
+        _start = us_ticker_read();
+    }
+}
 
-    _spi->write (cmd);
-    _sendaddr (paddr);
-    _deselect();
+AT45::OpTimer::~OpTimer()
+{
+    _at45->_opdepth--;
 
-    _busy();  // Check flash is not busy
+    if (_op)
+    {
+        _at45->_record (_op, _bytes, us_ticker_read() - _start);
+    }
 }
+#endif
 
-// Read from Flash memory into SRAM buffer
-void AT45::_flashread (int buffer, int address)
+// Little endian words of the records in the spare bytes
+void AT45::put_word(char* p, uint32_t word)
 {
+    p[0] = word;
+    p[1] = word >> 8;
+    p[2] = word >> 16;
+    p[3] = word >> 24;
+}
 
-    int cmd = 0;
-    int paddr = _getpaddr(address); // calculate page address
+uint32_t AT45::get_word(const char* p)
+{
+    return ((uint32_t)(unsigned char)p[0]) | ((uint32_t)(unsigned char)p[1] << 8)
+        | ((uint32_t)(unsigned char)p[2] << 16) | ((uint32_t)(unsigned char)p[3] << 24);
+}
 
-    _busy();  // Check flash is not busy
-    _select();
+// Fill (part of) an SRAM buffer, the buffer no longer mirrors a page afterwards
+void AT45::_bufferwrite(int buffer, int offset, const char* data, int length)
+{
+    if (buffer == _program_buffer)
+    {
+        _busy(); // the buffer may still be programming into the array
+    }
 
-    if (buffer == 1)
-        {cmd = 0x53;}
-    else
-        {cmd = 0x55;}
+    _bufpaddr[buffer - 1] = -1;
 
-    _spi->write (cmd);
-    _sendaddr (paddr);
+    _select();
+    _sendcmd ((buffer == 1) ? 0x84 : 0x87, offset);
+    _writedata (data, length);
     _deselect();
 }
 
-// Read directly from main memory
-int AT45::_memread (int address)
+// The SRAM buffer (1 or 2) holding a copy of a main memory page, 0 when neither does
+int AT45::_buffered(int paddr)
 {
+    if (paddr < 0)
+    {
+        return (0);
+    }
 
-    int data = 0;
-    int addr;
+    // a reserved buffer holds bytes the array does not have yet
+    if ((_bufpaddr[0] == paddr) && (_reserved != 1))
+    {
+        return (1);
+    }
 
-    addr = _getpaddr(address) | _getbaddr(address);
+    if ((_bufpaddr[1] == paddr) && (_reserved != 2))
+    {
+        return (2);
+    }
 
-    _busy();
+    return (0);
+}
 
-    _select();
+// SRAM buffer to fill next, the one not being programmed unless it is reserved
+int AT45::_fillbuffer()
+{
+    int buffer = (_program_buffer == 1) ? 2 : 1;
 
-    _spi->write (0xd2);  // Direct read command
-    _sendaddr (addr);
+    return (buffer == _reserved) ? _program_buffer : buffer;
+}
 
-    // 4 dont care bytes
-    _spi->write (0x00);
-    _spi->write (0x00);
-    _spi->write (0x00);
-    _spi->write (0x00);
+// A buffer has been programmed into a page, copies of the old page contents are stale
+void AT45::_mirror(int buffer, int paddr)
+{
+    if (paddr >= 0)
+    {
+        _invalidate(paddr, paddr + 1);
+    }
 
-    // this one clocks the data
-    data = _spi->write (0x00);
-    _deselect();
+    _bufpaddr[buffer - 1] = paddr;
+}
 
-    _busy();
+// Forget buffer copies of the pages with an address in [first, last)
+void AT45::_invalidate(int first, int last)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if ((_bufpaddr[i] >= first) && (_bufpaddr[i] < last))
+        {
+            _bufpaddr[i] = -1;
+        }
+    }
+}
 
-    return data;
+// Work out the device address of a page number, the page number shifted past the byte address bits
+int AT45::_pageaddress(int page)
+{
+    if (_pageshift < 0)
+    {
+        return (-1);
+    }
+
+    return (page << _pageshift);
 }
 
 // Work out the page address
@@ -959,49 +2476,148 @@ int AT45::_memread (int address)
 // If we have non-2^N, we use the shifted address
 int AT45::_getpaddr(int address)
 {
+    if (_pageshift < 0)
+    {
+        return (-1);
+    }
 
-    int paddr;
-
-    if (_pagesize == 256) {
-        paddr = address & 0xffffff00;}
-    else if (_pagesize == 264) {
-        paddr = (address << 1) & 0xfffffe00;}
-    else if (_pagesize == 512) {
-        paddr = address & 0xfffffe00;}
-    else if (_pagesize == 528 ) {
-       paddr = (address << 1) & 0xfffffc00;}
-    else if (_pagesize == 1024) {
-       paddr = address & 0xfffffc00;}
-    else if (_pagesize == 1056 ) {
-        paddr = (address << 1) & 0xfffff800;}
-    else {
-        paddr = -1;}
-
-    return (paddr);
+    return ((address >> _byteshift) << _pageshift);
 }
 
 // Clean the buffer address. This is the 8/9/10 LSBs
 int AT45::_getbaddr(int address)
 {
+    if (_pageshift < 0)
+    {
+        return (-1);
+    }
 
-    int baddr;
-
-    if ((_pagesize == 256) || (_pagesize == 264 )) {
-        baddr = address & 0xff;}
-    else if ((_pagesize == 512) || (_pagesize == 528 )) {
-        baddr = address & 0x1ff;}
-    else if ((_pagesize == 1024) || (_pagesize == 1056 )) {
-        baddr = address & 0x3ff;}
-    else {
-        baddr = -1;}
-
-    return (baddr);
+    return (address & _bytemask);
 }
 
 // Sends the three lest significant bytes of the supplied address
 void AT45::_sendaddr (int address)
 {
-    _spi->write(address >> 16);
-    _spi->write(address >> 8);
-    _spi->write(address);
-}
\ No newline at end of file
+    char addr[3];
+
+    addr[0] = address >> 16;
+    addr[1] = address >> 8;
+    addr[2] = address;
+
+    _spi->write(addr, sizeof(addr), NULL, 0);
+}
+
+// Sends the opcode, the 3 byte address and the dont care bytes as one block transfer
+void AT45::_sendcmd (int cmd, int address, int dummy)
+{
+    char header[8] = { 0 };
+
+    header[0] = cmd;
+    header[1] = address >> 16;
+    header[2] = address >> 8;
+    header[3] = address;
+
+    _spi->write(header, 4 + dummy, NULL, 0);
+}
+
+// Clocks a payload out of the device as one block transfer
+void AT45::_readdata (char* data, int length)
+{
+    _spi->write(NULL, 0, data, length);
+}
+
+// Clocks a payload into the device as one block transfer
+void AT45::_writedata (const char* data, int length)
+{
+    _spi->write(data, length, NULL, 0);
+}
+
+// Clocks the next length bytes of a segment list out of the device, one block transfer per segment
+// seg and skip track the position in the list across calls
+void AT45::_readdatav (const at45_iovec_t* iov, int* seg, int* skip, int length)
+{
+    while (length > 0)
+    {
+        int n = iov[*seg].length - *skip;
+
+        if (n > length)
+        {
+            n = length;
+        }
+
+        _readdata ((char*)iov[*seg].base + *skip, n);
+
+        length -= n;
+        *skip += n;
+        if (*skip == iov[*seg].length)
+        {
+            (*seg)++;
+            *skip = 0;
+        }
+    }
+}
+
+// Clocks the next length bytes of a segment list into the device, one block transfer per segment
+void AT45::_writedatav (const at45_iovec_t* iov, int* seg, int* skip, int length)
+{
+    while (length > 0)
+    {
+        int n = iov[*seg].length - *skip;
+
+        if (n > length)
+        {
+            n = length;
+        }
+
+        _writedata ((const char*)iov[*seg].base + *skip, n);
+
+        length -= n;
+        *skip += n;
+        if (*skip == iov[*seg].length)
+        {
+            (*seg)++;
+            *skip = 0;
+        }
+    }
+}
+
+#if DEVICE_SPI_ASYNCH
+// Runs from the SPI interrupt when an asynchronous transfer phase has completed
+void AT45::_async_handler(int event)
+{
+    _ncs = 1; // the asynch transfers don't hold the bus lock
+
+    if ((_async_state == AT45_ASYNC_WRITE_FILL) && (event & SPI_EVENT_COMPLETE))
+    {
+        // buffer is filled, chain the buffer to main memory program command
+        _async_state = AT45_ASYNC_WRITE_PROGRAM;
+        _ncs = 0;
+
+        if (_spi->transfer(_async_header, sizeof(_async_header), (char*)NULL, 0, mbed::callback(this, &AT45::_async_handler), SPI_EVENT_ALL) == 0)
+        {
+            return; // the program starts when chip select goes high at the end of the header
+        }
+
+        _ncs = 1;
+        event = SPI_EVENT_ERROR;
+    }
+
+    if (_async_state == AT45_ASYNC_WRITE_PROGRAM)
+    {
+        // chip select is high, the program is running from here, or the next command polls the status
+        _expect (AT45_T_EP_US);
+    }
+
+    if ((_async_state == AT45_ASYNC_WRITE_PROGRAM) && (event & SPI_EVENT_COMPLETE))
+    {
+        _mirror (_program_buffer, ((unsigned char)_async_header[1] << 16) | ((unsigned char)_async_header[2] << 8) | (unsigned char)_async_header[3]);
+    }
+
+    _async_state = AT45_ASYNC_IDLE;
+
+    if (_async_callback)
+    {
+        _async_callback.call(event);
+    }
+}
+#endif
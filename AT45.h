@@ -37,6 +37,61 @@
 #ifndef AT45_H
 #define AT45_H
 
+#define AT45_OUT_OF_MEMORY -4002
+#define AT45_CRC_MISMATCH -4003
+#define AT45_VERIFY_MISMATCH -4004
+#define AT45_WIPE_CANCELLED -4005
+
+#if !defined(AT45_STATS_ENABLED)
+#define AT45_STATS_ENABLED 0   // 1 = count and time the operations, see get_stats
+#endif
+
+#define AT45_STATS_BUCKETS 24  // latency histogram buckets, bucket n holds 2^(n-1) to 2^n - 1 us
+
+/** Counters of one operation type.
+ */
+typedef struct {
+    uint32_t count;      // operations
+    uint32_t bytes;      // bytes moved, or covered by the erases
+    uint64_t total_us;   // time the callers were blocked
+    uint32_t max_us;     // longest operation
+    uint32_t histogram[AT45_STATS_BUCKETS]; // operations by duration
+} at45_op_stats_t;
+
+/** Operation counters and timing, see AT45::get_stats.
+ */
+typedef struct {
+    at45_op_stats_t read;     // page, continuous, byte and spare reads
+    at45_op_stats_t program;  // page, partial, byte and spare writes
+    at45_op_stats_t erase;    // page, block, sector and chip erases
+    at45_op_stats_t status;   // status register reads
+    uint32_t busy_waits;      // waits for the device to become ready
+    uint32_t busy_polls;      // status reads during those waits
+    uint64_t busy_us;         // time spent waiting for the device
+    uint32_t lock_waits;      // commands that waited for the SPI bus
+    uint64_t lock_us;         // time spent waiting for the SPI bus
+    uint32_t sleeps;          // entries into deep or ultra-deep power down
+    uint32_t wakes;           // wake ups from deep or ultra-deep power down
+    uint64_t asleep_us;       // time spent powered down, up to the last wake up
+} at45_stats_t;
+
+/** One segment of a scatter/gather transfer.
+ */
+typedef struct {
+    void* base;  // first byte of the segment
+    int length;  // number of bytes in the segment
+} at45_iovec_t;
+
+/** Progress of a wipe, called with the pages covered by the erases issued so far and the pages
+ *  in the range, returns false to stop issuing erases.
+ */
+typedef Callback<bool(int, int)> at45_progress_t;
+
+// Integrity record in the spare bytes of a page, little endian words
+#define AT45_SPARE_CRC     0   // CRC32 of the page data
+#define AT45_SPARE_SEQ     4   // sequence number of the page program
+#define AT45_SPARE_RECORD  8   // bytes used, fits the 8 spare bytes of 264 byte pages
+
 //=============================================================================
 // Functions Declaration
 //=============================================================================
@@ -56,6 +111,34 @@
  */
 class AT45 {
 public:
+       /** Strategies to wait for the device to become ready after a program, erase or transfer.
+        */
+       enum WaitMode {
+           WAIT_POLL,       /**< Spin on the status register, one status read command per poll (default) */
+           WAIT_CONTINUOUS, /**< One status read command, status bytes are clocked with chip select held low */
+           WAIT_SLEEP,      /**< Sleep for the typical duration of the operation, then poll with sleeps in between */
+           WAIT_IRQ         /**< Sleep until the RDY/BUSY pin goes high (needs the RTOS) */
+       };
+
+       /** Low power states.
+        */
+       enum PowerDown {
+           POWER_DOWN_DEEP,      /**< Deep power down (0xB9), the SRAM buffers are kept, 35 us to wake */
+           POWER_DOWN_ULTRA_DEEP /**< Ultra-deep power down (0x79), the SRAM buffers are lost, 120 us to wake */
+       };
+
+       /** Supported parts, by manufacturer and device ID byte 1 as returned by id().
+        */
+       enum Part {
+           PART_UNKNOWN  = 0,      /**< Nothing known until probe() */
+           PART_AT45DB021 = 0x1f23, /**< 2 Mbit, 256/264 byte pages */
+           PART_AT45DB041 = 0x1f24, /**< 4 Mbit, 256/264 byte pages */
+           PART_AT45DB081 = 0x1f25, /**< 8 Mbit, 256/264 byte pages */
+           PART_AT45DB161 = 0x1f26, /**< 16 Mbit, 512/528 byte pages */
+           PART_AT45DB321 = 0x1f27, /**< 32 Mbit, 512/528 byte pages */
+           PART_AT45DB641 = 0x1f28  /**< 64 Mbit, 1024/1056 byte pages */
+       };
+
        /** Create an instance of the AT45 connected to specfied SPI pins, with the specified address.
         *
         * @param spi The mbed SPI instance (make in main routine)
@@ -63,13 +146,59 @@ public:
         */
        AT45(DestructableSPI* spi, PinName ncs);
 
+       /** Create an instance of the AT45 without talking to the device.
+        *
+        * The geometry is taken from the part and page size given, which must match the
+        * device. With PART_UNKNOWN nothing is known until probe() has been called.
+        *
+        * @param spi The mbed SPI instance (make in main routine)
+        * @param ncs The SPI chip select pin.
+        * @param part The part fitted, or PART_UNKNOWN.
+        * @param binary True when the device is configured for binary page sizes (256/512/1024).
+        */
+       AT45(DestructableSPI* spi, PinName ncs, Part part, bool binary);
+
+       /** Releases the RDY/BUSY interrupt of WAIT_IRQ.
+        */
+       ~AT45();
+
+       /** Read the ID and page size configuration of the device and resolve the geometry.
+        *
+        * The binary view is reset to whole pages and the integrity records are turned off.
+        *
+        * @return "0" when a supported part answered, "-1" when it didn't
+        */
+       int probe(void);
+
        /** Read a byte.
         *
+        * Use read_bytes to read more than one byte.
         * @param address The address of the byte to read.
         * @return The data in the byte.
         */
        char read_byte(int address);
 
+       /** Read consecutive bytes.
+        *
+        * One opcode for the whole range, served from an SRAM buffer when the range lies in a page
+        * a buffer holds, otherwise streamed with a continuous array read across page boundaries.
+        * @param address The byte address to start reading from (page * page size + offset in page).
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data that is read into.
+        * @param length The number of bytes to read.
+        * @return Returns "0" or "-1" for error.
+        */
+       int read_bytes(int address, char* data, int length);
+
+       /** Read consecutive bytes into a list of segments.
+        *
+        * Continuous array read, each segment is filled by its own SPI burst while chip select stays low.
+        * @param address The byte address to start reading from (page * page size + offset in page).
+        * @param iov The segments to read into, in order.
+        * @param count The number of segments.
+        * @return Returns "0", "-1" for error or AT45_CRC_MISMATCH (see set_integrity).
+        */
+       int read_bytesv(int address, const at45_iovec_t* iov, int count);
+
        /** Read a page.
         *
         * @param data The data is pointer to a userdefined array that the page is read into.
@@ -78,6 +207,16 @@ public:
         */
        int read_page(char* data, int page);
 
+       /** Read consecutive bytes with a continuous array read (0x0B).
+        *
+        * Streams across page boundaries in a single chip select window, without going through the SRAM buffers.
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data that is read into.
+        * @param address The byte address to start reading from (page * page size + offset in page).
+        * @param length The number of bytes to read.
+        * @return Returns "0" or "-1" for error.
+        */
+       int read_continuous(char* data, int address, int length);
+
        /** Read a block (from 1 dimension array).
         *
         * @param data The data is pointer to a userdefined array that holds 4096 bytes of the data that is read into.
@@ -97,6 +236,7 @@ public:
 
        /** Write a byte.
         *
+        * Read-modify-write of the page holding the byte, use write_bytes to update more than one byte.
         * @param address The address to where the data is storage in the flash.
         * @param data The data to write into the flash.
         */
@@ -104,11 +244,214 @@ public:
 
        /** Write a page.
         *
+        * Alternates between the two SRAM buffers, the buffer is filled while the previous page is still programming.
         * @param data The data is pointer to a userdefined array that holds the data to write into.
         * @param page The page number of the page to write into (0 to device page size).
+        * @param erase True = program with built-in erase (0x83/0x86), False = the page is already erased (0x88/0x89, about half the program time).
+        * @return Returns "0", "-1" for error or AT45_VERIFY_MISMATCH (see set_program_verify).
+        */
+       int write_page(const char* data, int page, bool erase = true);
+
+       /** Write consecutive pages.
+        *
+        * Pipelined over both SRAM buffers, one buffer is filled over SPI while the other one is programmed into the array.
+        * @param data The data is pointer to a userdefined array that holds count x page size bytes of the data to write into.
+        * @param page The page number of the first page to write into (0 to device page size).
+        * @param count The number of pages to write.
+        * @param erase True = program with built-in erase (0x83/0x86), False = the pages are already erased (0x88/0x89).
+        * @return Returns "0" or "-1" for error.
+        */
+       int write_pages(const char* data, int page, int count, bool erase = true);
+
+       /** Write part of a page.
+        *
+        * Read-modify-write through an SRAM buffer, the rest of the page keeps its contents. The page is only
+        * transferred into the buffer when no buffer holds it yet, with built-in erase the bytes are patched and
+        * programmed in one Main Memory Page Program through Buffer command (0x82/0x85).
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data to write into.
+        * @param page The page number of the page to write into (0 to device page size).
+        * @param offset The offset of the first byte in the page.
+        * @param length The number of bytes to write, offset + length must not cross the end of the page.
+        * @param erase True = program with built-in erase, False = the page is already erased.
+        * @return Returns "0" or "-1" for error.
+        */
+       int write_partial(const char* data, int page, int offset, int length, bool erase = true);
+
+       /** Write consecutive bytes.
+        *
+        * Each page in the range is loaded into an SRAM buffer once, patched and programmed once
+        * (0x82/0x85), whole pages in the range are written without loading them first.
+        * @param address The byte address to start writing to (page * page size + offset in page).
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data to write into.
+        * @param length The number of bytes to write, the range may span pages.
+        * @return Returns "0" or "-1" for error.
+        */
+       int write_bytes(int address, const char* data, int length);
+
+       /** Write consecutive bytes gathered from a list of segments.
+        *
+        * Each touched page is filled with one buffer write (0x84/0x87) that clocks out the segments back to
+        * back, and programmed once. Pages only partly covered by the range are loaded into the buffer first.
+        * @param address The byte address to start writing to (page * page size + offset in page).
+        * @param iov The segments to write, in order.
+        * @param count The number of segments.
+        * @param erase True = program with built-in erase, False = the pages are already erased.
+        * @return Returns "0", "-1" for error or AT45_VERIFY_MISMATCH (see set_program_verify).
+        */
+       int write_bytesv(int address, const at45_iovec_t* iov, int count, bool erase = true);
+
+       /** Rewrite a page with its own contents.
+        *
+        * Auto Page Rewrite (0x58/0x59), refreshes a page whose neighbours in the sector have been
+        * programmed many times. The data never crosses the SPI bus.
+        * @param page The page number of the page to rewrite (0 to device page size).
+        * @return Returns "0" or "-1" for error.
+        */
+       int page_rewrite(int page);
+
+       /** Read the spare bytes of a page.
+        *
+        * @param data The data is pointer to a userdefined array that holds sparesize bytes of the data that is read into.
+        * @param page The page number of the page to read (0 to device page size).
+        * @return Returns "0" or "-1" for error (no binary view).
+        */
+       int read_spare(char* data, int page);
+
+       /** Write the spare bytes of a page.
+        *
+        * Read-modify-write through an SRAM buffer, the data bytes of the page keep their contents.
+        * @param data The data is pointer to a userdefined array that holds sparesize bytes of the data to write into.
+        * @param page The page number of the page to write into (0 to device page size).
+        * @param erase True = program with built-in erase, False = the spare bytes are erased.
+        * @return Returns "0" or "-1" for error (no binary view, or integrity checks on).
+        */
+       int write_spare(const char* data, int page, bool erase = true);
+
+       /** Read the spare bytes of consecutive pages.
+        *
+        * Only the spare bytes are clocked, a few bytes per page rather than the whole page.
+        * @param data The data is pointer to a userdefined array that holds count x sparesize bytes of the data that is read into.
+        * @param page The page number of the first page (0 to device page size).
+        * @param count The number of pages.
+        * @return Returns "0" or "-1" for error (no binary view).
+        */
+       int read_spares(char* data, int page, int count);
+
+       /** Write a page and its spare bytes with one page program.
+        *
+        * @param data The data is pointer to a userdefined array that holds pagesize bytes of the data to write into, NULL to leave the data erased (0xFF).
+        * @param spare The data is pointer to a userdefined array that holds sparesize bytes of the spare bytes to write into.
+        * @param page The page number of the page to write into (0 to device page size).
+        * @param erase True = program with built-in erase, False = the page is erased.
+        * @return Returns "0" or "-1" for error (no binary view, or integrity checks on).
+        */
+       int write_page_spare(const char* data, const char* spare, int page, bool erase = true);
+
+       /** Store a little endian word, the byte order of the records in the spare bytes.
+        *
+        * @param p The four bytes to store the word in.
+        * @param word The word.
+        */
+       static void put_word(char* p, uint32_t word);
+
+       /** Load a little endian word, the byte order of the records in the spare bytes.
+        *
+        * @param p The four bytes holding the word.
+        * @return The word.
+        */
+       static uint32_t get_word(const char* p);
+
+       /** Write into an SRAM buffer.
+        *
+        * Waits when the buffer may still be programming into the array.
+        * @param buffer The SRAM buffer, 1 or 2.
+        * @param offset The offset of the first byte in the buffer.
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data to write into.
+        * @param length The number of bytes, up to the end of the page data.
+        * @return Returns "0" or "-1" for error.
+        */
+       int buffer_write(int buffer, int offset, const char* data, int length);
+
+       /** Program an SRAM buffer into a page.
+        *
+        * Returns once the program has been issued (unless program verify is on), the buffer is
+        * left holding a copy of the page.
+        * @param buffer The SRAM buffer, 1 or 2.
+        * @param page The page number of the page to write into (0 to device page size).
+        * @param erase True = program with built-in erase, False = the page is erased.
+        * @return Returns "0", "-1" for error or AT45_VERIFY_MISMATCH.
+        */
+       int buffer_program(int buffer, int page, bool erase = true);
+
+       /** Load a page into an SRAM buffer.
+        *
+        * Skips the transfer when a buffer already holds a copy of the page.
+        * @param page The page number of the page to load (0 to device page size).
+        * @return The SRAM buffer holding the page, 1 or 2, or "-1" for error.
+        */
+       int buffer_load(int page);
+
+       /** Keep the other functions out of an SRAM buffer.
+        *
+        * While a buffer is reserved, page writes, loads, compares and reads through a buffer
+        * use the other buffer, so bytes written with buffer_write stay until buffer_program.
+        * Ultra-deep power down still loses them.
+        * @param buffer The SRAM buffer to reserve, 1 or 2, or 0 to release the reservation.
         * @return Returns "0" or "-1" for error.
         */
-       int write_page(char* data, int page);
+       int buffer_reserve(int buffer);
+
+       /** SRAM buffer that may still be programming into the array.
+        *
+        * @return The SRAM buffer used by the last page program, 1 or 2.
+        */
+       int program_buffer(void);
+
+       /** Compare a page with data, on the chip.
+        *
+        * The data is uploaded into an SRAM buffer once and compared with the page by Main Memory Page to
+        * Buffer Compare (0x60/0x61), nothing is read back over SPI. With the binary view the spare bytes
+        * are taken from the page.
+        * @param data The data is pointer to a userdefined array that holds the page size bytes to compare with.
+        * @param page The page number of the page to compare (0 to device page size).
+        * @return Returns "0", "-1" for error or AT45_VERIFY_MISMATCH when the page differs.
+        */
+       int verify_page(const char* data, int page);
+
+       /** Compare every page program with the buffer it came from.
+        *
+        * The page writes wait for the page program and compare the page with the SRAM buffer that still
+        * holds the programmed data, they return AT45_VERIFY_MISMATCH when the page differs. Costs one
+        * compare per page, the buffer fill of the next page no longer overlaps with the page program.
+        * The asynchronous page writes are not verified.
+        * @param onoff True = verify and False = no verify (default).
+        */
+       void set_program_verify(bool onoff);
+
+       /** Store and check a CRC32 of each page in its spare bytes.
+        *
+        * Needs the binary view. Page writes put the CRC of the page data and a sequence number in the
+        * spare bytes (AT45_SPARE_CRC, AT45_SPARE_SEQ), read_page and read_continuous check every page
+        * they read entirely. Erased pages pass. write_spare is not available while the checks are on.
+        * The first page write after turning the checks on reads the spare bytes of every page, so the
+        * sequence number carries on after the highest one on the device rather than restarting at 0
+        * after a reset. Turning the checks on and reading stays quick.
+        * @param onoff True = integrity checks and False = spare bytes left erased (default).
+        * @return Returns "0" or "-1" for error (no binary view).
+        */
+       int set_integrity(bool onoff);
+
+       /** Digest of the integrity records of consecutive pages.
+        *
+        * Reads only the spare bytes of each page and computes a CRC32 over the page CRCs, to compare
+        * with the digest of a known image without reading the image. Also moves the sequence number
+        * past every page seen.
+        * @param page The page number of the first page.
+        * @param count The number of pages.
+        * @param digest Receives the CRC32 over the page CRCs.
+        * @return Returns "0", "-1" for error or AT45_CRC_MISMATCH when a page has no record.
+        */
+       int spare_digest(int page, int count, uint32_t* digest);
 
        /** Write a block (from 1 dimension array).
         *
@@ -160,16 +503,69 @@ public:
 
        /** Function to erase the selected block.
         *
+        * Returns once the erase has been issued, the next command waits for it to complete.
         * @param block The selected block to erase.
         */
        void block_erase(int block);
 
-       /** Function to erase the selected block.
+       /** Function to erase the selected page.
         *
+        * Returns once the erase has been issued, the next command waits for it to complete.
         * @param page The number of the page to erase.
         */
        void page_erase(int page);
 
+       /** Function to erase the selected sector.
+        *
+        * Sector 0 covers both sector 0a (block 0) and sector 0b.
+        * Returns once the erase has been issued, the next command waits for it to complete.
+        * @param sector The selected sector to erase.
+        */
+       void sector_erase(int sector);
+
+       /** Function to erase a range of pages.
+        *
+        * Aligned runs are erased with sector erase (0x7C) and block erase (0x50),
+        * page erase (0x81) is only used for the unaligned edges.
+        * @param page The number of the first page to erase.
+        * @param count The number of pages to erase.
+        * @return Returns "0" or "-1" for error.
+        */
+       int erase_pages(int page, int count);
+
+       /** Function to erase a range of pages for a factory reset, without chip erase.
+        *
+        * Erases like erase_pages, with sector erase (0x7C) and block erase (0x50), and returns once the
+        * last erase has completed. Every erase is issued after a ready wait for the one before it.
+        * @param page The number of the first page to erase.
+        * @param count The number of pages to erase, _pages - page for the rest of the device.
+        * @param progress Called after each erase has been issued, returns false to cancel.
+        * @return Returns "0", AT45_WIPE_CANCELLED when cancelled or "-1" for error.
+        */
+       int wipe(int page, int count, at45_progress_t progress = at45_progress_t());
+
+       /** Start erasing a range of pages in the background.
+        *
+        * Nothing is issued until the first wipe_poll. Other commands in between wait for the erase in flight.
+        * @param page The number of the first page to erase.
+        * @param count The number of pages to erase.
+        * @return Returns "0" or "-1" for error.
+        */
+       int wipe_start(int page, int count);
+
+       /** Advance a background wipe.
+        *
+        * Never waits for the device, issues the next erase once the one before it has completed.
+        * Call it again until it returns 0, such as from an event queue every few milliseconds.
+        * @param done Receives the pages covered by the erases issued so far, or NULL.
+        * @return Returns "1" while the wipe is in progress and "0" once the last erase has completed.
+        */
+       int wipe_poll(int* done = NULL);
+
+       /** Stop a background wipe, the erase in flight still completes.
+        */
+       void wipe_cancel(void);
+
        /** Device size in mbits.
         *
         * @return device size.
@@ -187,11 +583,37 @@ public:
         * for 2-8 Mbits 256 or 264
         * for 16-32 Mbits 512 or 528
         * for 64 Mbits 1024 or 1056
+        * 256, 512 or 1024 with the binary view.
         *
         * @return Page size.
         */
        int pagesize(void);
 
+       /** Spare bytes per page.
+        *
+        * The bytes after the binary part of a non-2^N page (8, 16 or 32), only with the binary view.
+        * @return Spare size, 0 without the binary view.
+        */
+       int sparesize(void);
+
+       /** Is the device configured for binary (2^N) page sizes.
+        *
+        * Reads the page size configuration from the status register.
+        * @return True = binary and False = DataFlash page sizes.
+        */
+       bool is_binary(void);
+
+       /** Expose the binary part of DataFlash sized pages.
+        *
+        * The page functions (read_page, write_page, read_continuous, read_bytes, ...) then see 256, 512 or
+        * 1024 byte pages without reconfiguring the device. The remaining bytes of each page become a spare
+        * area for read_spare and write_spare, whole page writes program it erased (0xFF).
+        * The byte and FAT functions keep their address format.
+        * @param onoff True = binary view and False = whole pages (default).
+        * @return Returns "0" or "-1" for error.
+        */
+       int set_binary_view(bool onoff);
+
        /** Function to set the page size to binary.
         *
         *  Remenber is a one-time programmable configuration.
@@ -205,12 +627,27 @@ public:
         */
        int blocks(void);
 
+       /** sectors in flash.
+        *
+        * @return Numbers af sectors.
+        */
+       int sectors(void);
+
        /** ID of the device.
         *
         * @return Manufacturer, Family and Density code.
         */
        int id(void);
 
+       /** Check the SPI bus at the current clock.
+        *
+        * Writes a test pattern into the SRAM buffer not used by the last page
+        * program and reads it back, the copy of a page that buffer held is lost.
+        *
+        * @return "0" when the pattern reads back, "-1" when it doesn't
+        */
+       int bus_test(void);
+
        /** Status register.
         *
         * @return The status register.
@@ -220,22 +657,160 @@ public:
        /** busy ?.
         *
         * Function will want to the device is not busy.
+        * Returns straight away when no program, erase or transfer is in flight.
         */
        void busy(void); // Wait until Flash is not busy
 
+       /** Is an operation in flight.
+        *
+        * Does not block, only reads the status register once the typical duration of the operation has elapsed.
+        * @return True = busy and False = ready.
+        */
+       bool is_busy(void);
+
+       /** Get the operation counters.
+        *
+        * Only counted when built with AT45_STATS_ENABLED, the counters stay 0 otherwise. Timing uses the us ticker,
+        * an operation is timed from the call until it returns, nested calls are part of the outermost one.
+        * @param stats Receives the counters since construction or reset_stats.
+        */
+       void get_stats(at45_stats_t* stats);
+
+       /** Clear the operation counters.
+        */
+       void reset_stats(void);
+
+       /** Latency percentile of an operation type.
+        *
+        * Resolution is the log2 histogram, the upper bound of the bucket that holds the percentile is returned.
+        * @param op The counters of one operation type, from get_stats.
+        * @param percent The percentile, 50 for the median.
+        * @return The latency in us, 0 when nothing was counted.
+        */
+       static uint32_t stats_percentile(const at45_op_stats_t* op, int percent);
+
        /** Deep Power Down.
         *
-        * Remenber that you have to want 35uS after the wake up to use the device.
+        * The wake up time is waited for before the next command.
         * @param True = Activate and False = Wake Up.
         */
        void deep_power_down(bool onoff);
 
-       /** Is the device deep power down.
+       /** Is the device awake.
         *
-        * @return True = Activate and False = Awake.
+        * @return True = Awake and False = Powered down.
         */
        bool is_it_awake(void);
 
+       /** Enter a low power state.
+        *
+        * Waits for a program or erase in flight first. The next command wakes the device.
+        * @param mode Deep or ultra-deep power down.
+        */
+       void power_down(PowerDown mode);
+
+       /** Start waking the device from a low power state.
+        *
+        * Returns without waiting for the wake up time, the next command waits for what is left
+        * of it, so work done in between overlaps the wake up. Does nothing when the device is awake.
+        */
+       void wake(void);
+
+       /** Select how to wait for the device to become ready.
+        *
+        * WAIT_SLEEP and WAIT_IRQ let other threads run while a page program or an erase is in progress.
+        * @param mode The ready wait strategy.
+        * @param rdybsy The pin connected to RDY/BUSY, only used with WAIT_IRQ.
+        * @return Returns "0" or "-1" for error.
+        */
+       int set_wait_mode(WaitMode mode, PinName rdybsy = NC);
+
+       /** Does one of the SRAM buffers hold a copy of a page.
+        *
+        * The buffers keep the last pages that were programmed or loaded, read_page, read_byte and read_bytes
+        * are served straight from a buffer that holds the page.
+        * @param page The page number.
+        * @return True = a buffer holds the page.
+        */
+       bool is_buffered(int page);
+
+       /** Check the SRAM buffer copies against main memory.
+        *
+        * Uses Main Memory Page to Buffer Compare (0x60/0x61) and forgets the copies that don't match,
+        * call this after power events that may have cleared the buffers.
+        * @return The number of buffers that still hold a valid copy.
+        */
+       int validate_buffers(void);
+
+#if DEVICE_SPI_ASYNCH
+       /** Read a page without blocking on the payload transfer.
+        *
+        * The page is loaded into SRAM buffer 1 and the command header is sent synchronously,
+        * the payload is then streamed through DestructableSPI::transfer (using DMA when enabled
+        * with set_dma_usage on the SPI instance). Chip select is released from the SPI interrupt.
+        * Do not use the SPI bus or the device until the callback has fired.
+        * @param data The data is pointer to a userdefined array that the page is read into.
+        * @param page The page number of the page to read (0 to device page size).
+        * @param callback Called from interrupt context with the SPI event when the transfer is done.
+        * @return Returns "0" or "-1" for error.
+        */
+       int read_page_async(char* data, int page, const event_callback_t& callback);
+
+       /** Write a page without blocking on the payload transfer.
+        *
+        * The buffer fill and the buffer to main memory program command are both sent through
+        * DestructableSPI::transfer. The callback fires once the program command has been issued,
+        * the device is busy programming the page after that.
+        * Do not use the SPI bus or the device until the callback has fired.
+        * @param data The data is pointer to a userdefined array that holds the data to write into (must stay valid until the callback).
+        * @param page The page number of the page to write into (0 to device page size).
+        * @param callback Called from interrupt context with the SPI event when the transfer is done.
+        * @return Returns "0" or "-1" for error.
+        */
+       int write_page_async(const char* data, int page, const event_callback_t& callback);
+
+       /** Is an asynchronous page transfer in progress.
+        *
+        * @return True = transfer in progress, False = idle.
+        */
+       bool is_async_busy(void);
+#endif
+
+       /** Start a continuous array read (0x0B) that stays open.
+        *
+        * Chip select stays low and the SPI bus stays locked until stream_close, so
+        * do not use the device for anything else in between.
+        * @param page The page number of the first page (0 to device page size).
+        * @param offset The offset of the first byte in the page, including the spare bytes.
+        * @return Returns "0" or "-1" for error.
+        */
+       int stream_open(int page, int offset);
+
+       /** Clock the next bytes of an open continuous read.
+        *
+        * The read runs on through the spare bytes into the next page.
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data that is read into.
+        * @param length The number of bytes.
+        */
+       void stream_read(char* data, int length);
+
+#if DEVICE_SPI_ASYNCH
+       /** Clock the next bytes of an open continuous read without blocking.
+        *
+        * The bytes are clocked in by DestructableSPI::transfer (using DMA when enabled with
+        * set_dma_usage on the SPI instance).
+        * @param data The data is pointer to a userdefined array that holds length bytes of the data that is read into.
+        * @param length The number of bytes.
+        * @param callback Called from interrupt context with the SPI event when the transfer is done.
+        * @return Returns "0" or "-1" for error.
+        */
+       int stream_read_async(char* data, int length, const event_callback_t& callback);
+#endif
+
+       /** End a continuous read started by stream_open.
+        */
+       void stream_close(void);
+
 private:
 
         DestructableSPI* _spi;
@@ -243,16 +818,81 @@ private:
 
         int _pages;            // Integer number of pages
         int _pagesize;         // page size, in bytes
+        int _pageshift;        // page number to device page address shift, -1 when unknown
+        int _byteshift;        // byte address bits of the page address format used by read_byte/write_byte/FAT
+        int _bytemask;         // mask of those byte address bits
+        int _datasize;         // page bytes seen by the page functions, the binary part with the binary view
+        bool _integrity;       // keep a CRC record in the spare bytes
+        bool _verify;          // compare every page program with its buffer
+        uint32_t _seq;         // sequence number of the next page program
+        bool _seqknown;        // _seq is past every record on the device
+        uint32_t _erasedcrc;   // CRC32 of an erased page
         int _devicesize;       // device size in bytes
         int _blocks;           // Number of blocks
-        bool _deep_down;       // True = the device is deep down
-        bool _deep_down_onoff; // variable for deep power down function (On/Off)
+        int _sectors;          // Number of sectors
+        int _sectorpages;      // Pages per sector
+        int _wipe_start;       // first page of a background wipe
+        int _wipe_page;        // next page of a background wipe
+        int _wipe_end;         // page after the end of a background wipe, _wipe_page when none
+        bool _asleep;          // in deep or ultra-deep power down
+        PowerDown _sleep_mode; // low power state while asleep
+        uint32_t _wake_start;  // us ticker when the device was told to wake up
+        int _wake_us;          // wake up time still to be waited for from _wake_start, 0 when awake
+        us_timestamp_t _sleep_start; // when the device last powered down, for the stats
+        int _program_buffer;   // SRAM buffer (1 or 2) used by the last page program
+        int _reserved;         // SRAM buffer held by buffer_reserve, 0 when none
+        int _bufpaddr[2];      // page address each SRAM buffer holds a copy of, -1 when unknown
+        WaitMode _wait_mode;   // ready wait strategy
+        volatile bool _inflight;   // a program, erase or transfer may still be running
+        volatile uint32_t _busy_start; // us ticker when the operation in flight was issued
+        volatile int _busy_us;     // typical duration of the operation in flight, in us
+        InterruptIn* _rdybsy;  // RDY/BUSY pin for WAIT_IRQ
+#if MBED_CONF_RTOS_PRESENT
+        Semaphore* _ready;     // released on the RDY/BUSY rising edge
+#endif
+
+#if DEVICE_SPI_ASYNCH
+        volatile int _async_state;       // state of the asynchronous page transfer
+        event_callback_t _async_callback; // user callback for the asynchronous page transfer
+        char _async_header[4];           // program command sent after an asynchronous buffer fill
+#endif
+
+        at45_stats_t _stats;   // operation counters, with AT45_STATS_ENABLED
+        int _opdepth;          // nesting of the timed public operations
+
+#if AT45_STATS_ENABLED
+        // Times a public operation for as long as it is in scope
+        class OpTimer {
+        public:
+            OpTimer(AT45* at45, at45_op_stats_t* op, int bytes);
+            ~OpTimer();
+        private:
+            AT45* _at45;
+            at45_op_stats_t* _op;   // NULL when nested in another operation
+            int _bytes;
+            uint32_t _start;
+        };
+
+        void _record (at45_op_stats_t* op, int bytes, uint32_t us);
+#endif
 
         // Helper routunes
+        void _defaults();
         void _initialize();
+        void _geometry(int id, int status);
         void _select();
         void _deselect();
         void _busy (void);
+        void _awake (void);
+        void _release (int us);
+        void _expect (int us);
+        void _sleep (int us);
+        int _remaining_us (void);
+#if MBED_CONF_RTOS_PRESENT
+        void _ready_irq (void);
+#endif
+        void _freeirq (void);
+        int _recoverseq (void);
 
         // accessing SRAM buffers
         void _sramwrite (int buffer, int address, int data);
@@ -262,16 +902,52 @@ private:
         void _flashwrite (int buffer, int paddr);
         void _flashread (int buffer, int paddr);
 
+        // Tracking the pages held by the SRAM buffers
+        int _loadbuffer (int paddr);
+        void _bufferwrite (int buffer, int offset, const char* data, int length);
+        int _program (int buffer, int paddr, bool erase);
+        int _erasestep (int page, int end);
+        int _fillbuffer (void);
+        int _patch (int paddr, int offset, const char* data, int length, bool erase);
+        int _verified (int buffer, int paddr);
+        int _compare (int buffer, int paddr);
+        void _sealspare (int buffer, const char* data);
+        void _sealrecord (int buffer, uint32_t crc);
+        int _checkspare (const char* spare, const char* data);
+        int _checkrecord (const char* spare, uint32_t crc);
+        uint32_t _crc (const char* data, int length);
+        uint32_t _crcv (const at45_iovec_t* iov, int seg, int skip, int length);
+        int _iovlength (const at45_iovec_t* iov, int count);
+        uint32_t _buffercrc (int buffer);
+        int _buffered (int paddr);
+        void _mirror (int buffer, int paddr);
+        void _invalidate (int first, int last);
+
         // Reading FLASH directly
         int _memread (int address);
 
         // Calculate page/subpage addresses
+        int _pageaddress (int page);
         int _getpaddr (int);
         int _getbaddr (int);
 
         // Send 3 byte address
         void _sendaddr (int address);
 
+        // Send opcode, 3 byte address and up to 4 dont care bytes in one transfer
+        void _sendcmd (int cmd, int address, int dummy = 0);
+
+        // Bulk payload transfers, one SPI block transfer per call
+        void _readdata (char* data, int length);
+        void _writedata (const char* data, int length);
+        void _readdatav (const at45_iovec_t* iov, int* seg, int* skip, int length);
+        void _writedatav (const at45_iovec_t* iov, int* seg, int* skip, int length);
+
+#if DEVICE_SPI_ASYNCH
+        // Completion handler for the asynchronous page transfers, runs in interrupt context
+        void _async_handler (int event);
+#endif
+
 };
 #endif
 
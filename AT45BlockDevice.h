@@ -5,47 +5,483 @@
 #include "DestructableSPI.h"
 #include "BlockDevice.h"
 #include "AT45.h"
+#include "AT45PageCache.h"
 #include "mbed_debug.h"
-
-#if !defined(AT45_BLOCK_DEVICE_DEBUG)
-#define at45_debug(...) do {} while(0)
-#else
-#define at45_debug(...) printf(__VA_ARGS__)
-#endif
+#include "AT45Config.h"
 
 class AT45BlockDevice : public BlockDevice {
 public:
 
+    /** How the work of erasing pages is split between erase() and program()
+     */
+    enum EraseMode {
+        ERASE_EXPLICIT,     /**< erase() erases, program() programs with built-in erase (default) */
+        ERASE_AUTO,         /**< erase() is a no-op, program() programs with built-in erase */
+        ERASE_PRE_ERASED    /**< erase() erases, program() skips the built-in erase, the pages must have been erased */
+    };
+
+    /** Counters of the device and the page cache
+     */
+    struct Stats {
+        at45_stats_t device;        /**< operation counts, bytes and latency, with AT45_STATS_ENABLED */
+        AT45PageCache::Stats cache; /**< page cache hits and misses */
+    };
+
     /**
      * Initialize a block device on an AT45 SPI flash chip.
-     * Size and number of pages are determined directly from the chip itself.
+     * Size and number of pages are determined directly from the chip itself,
+     * the first time init() is called. The constructor does not talk to the
+     * device.
      *
      * @param mosi SPI MOSI pin
      * @param miso SPI MISO pin
      * @param sck  SPI SCK pin
      * @param nss  SPI chip-select pin
+     * @param hz   SPI clock in Hz
+     * @param mode SPI mode, 0 or 3
      */
-    AT45BlockDevice(PinName mosi, PinName miso, PinName sck, PinName nss)
-        : spi(mosi, miso, sck, nss), at45(&spi, nss)
+    AT45BlockDevice(PinName mosi, PinName miso, PinName sck, PinName nss,
+                    int hz = MBED_CONF_AT45_SPI_FREQUENCY, int mode = MBED_CONF_AT45_SPI_MODE)
+        : spi(mosi, miso, sck, nss), at45(&spi, nss, AT45::PART_UNKNOWN, false), cache(&at45), cache_pages(0),
+          subpage_size(0), binary_view(false), integrity(false), active(false), idle_event(0),
+          idle_timeout(MBED_CONF_AT45_IDLE_TIMEOUT_MS), last_access(0),
+          idle_mode(MBED_CONF_AT45_IDLE_ULTRA_DEEP ? AT45::POWER_DOWN_ULTRA_DEEP : AT45::POWER_DOWN_DEEP),
+          wipe_event(0), wipe_pages(0), erase_mode(ERASE_EXPLICIT)
     {
-        pagesize = at45.pagesize();
-        totalsize = pagesize * at45.pages();
+
+        spi.format(8, mode);
+        spi.frequency(hz);
+        frequency = hz;
+
+        geometry();
+    }
+
+    /**
+     * Initialize a block device on a known AT45 part, without reading the
+     * geometry from the chip. Saves the ID and status reads in init(), the
+     * part and page size configuration must match the chip.
+     *
+     * @param mosi   SPI MOSI pin
+     * @param miso   SPI MISO pin
+     * @param sck    SPI SCK pin
+     * @param nss    SPI chip-select pin
+     * @param part   The part fitted
+     * @param binary True when the chip is configured for binary page sizes
+     * @param hz     SPI clock in Hz
+     * @param mode   SPI mode, 0 or 3
+     */
+    AT45BlockDevice(PinName mosi, PinName miso, PinName sck, PinName nss, AT45::Part part, bool binary,
+                    int hz = MBED_CONF_AT45_SPI_FREQUENCY, int mode = MBED_CONF_AT45_SPI_MODE)
+        : spi(mosi, miso, sck, nss), at45(&spi, nss, part, binary), cache(&at45), cache_pages(0),
+          subpage_size(0), binary_view(false), integrity(false), active(false), idle_event(0),
+          idle_timeout(MBED_CONF_AT45_IDLE_TIMEOUT_MS), last_access(0),
+          idle_mode(MBED_CONF_AT45_IDLE_ULTRA_DEEP ? AT45::POWER_DOWN_ULTRA_DEEP : AT45::POWER_DOWN_DEEP),
+          wipe_event(0), wipe_pages(0), erase_mode(ERASE_EXPLICIT)
+    {
+
+        spi.format(8, mode);
+        spi.frequency(hz);
+        frequency = hz;
+
+        geometry();
     }
 
     virtual ~AT45BlockDevice() {
+        cancel_idle();
+        cancel_wipe();
     }
 
     /** Initialize a block device
+     *
+     *  Reads the geometry from the chip the first time, retrying for up to
+     *  MBED_CONF_AT45_DETECT_TIMEOUT_US while the chip powers up, and
+     *  allocates the page cache when one has been configured. After deinit()
+     *  the SPI interface is set up again.
      *
      *  @return         0 on success or a negative error code on failure
      */
     virtual int init() {
+        spi.init(); // deinit() released it, before Access wakes the chip through it
+
+        Access access(this);
+
+        if (at45.pages() <= 0) {
+            int r = detect();
+            if (r != 0) {
+                return r;
+            }
+        }
+
+        at45_debug("[AT45] %s page size %d, block size %llu, spare %d\n",
+            at45.is_binary() ? "binary" : "DataFlash", at45.pagesize() + at45.sparesize(),
+            pagesize, at45.sparesize());
+
+#if defined(AT45_BLOCK_DEVICE_CONVERT_TO_BINARY)
+        // one-shot conversion, the configuration is one-time programmable on older parts
+        // and only takes effect after a power cycle
+        if (!at45.is_binary()) {
+            at45_debug("[AT45] setting binary page size, power cycle the device\n");
+            at45.set_pageszie_to_binary();
+            return BD_ERROR_DEVICE_ERROR;
+        }
+#endif
+
+#if MBED_CONF_AT45_SPI_PROBE
+        probe_frequency(MBED_CONF_AT45_SPI_PROBE_MAX);
+        at45_debug("[AT45] SPI clock %d Hz\n", frequency);
+#endif
+
+        // recovers the sequence number of the integrity records from the spare bytes
+        if (at45.set_integrity(integrity) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        int r = cache.init(cache_pages, pagesize);
+        if (r != 0) {
+            at45_debug("[AT45] cache allocation failed (%d)\n", r);
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        active = true;
+
         return BD_ERROR_OK;
     }
 
+    /** Deinitialize a block device
+     *
+     *  Programs dirty cached pages and waits for the last page program before
+     *  releasing the SPI interface, so this is safe to call before a bootloader
+     *  jumps to the application
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
     virtual int deinit() {
+        Access access(this);
+
+        // the next owner of the chip finds it awake
+        active = false;
+        cancel_idle();
+        cancel_wipe();
+
+        int r = cache.flush(erase_mode != ERASE_PRE_ERASED);
+
+        at45.busy();
+        cache.deinit();
         spi.free();
 
+        return r;
+    }
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  Programs dirty cached pages, and as program() returns as soon as the
+     *  last page program has been issued, waits for it to complete
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync() {
+        Access access(this);
+
+        int r = cache.flush(erase_mode != ERASE_PRE_ERASED);
+
+        at45.busy();
+
+        return r;
+    }
+
+    /** Configure the write-back page cache
+     *
+     *  The slots are allocated in init(), so call this before init(). Reads
+     *  of single pages are kept in the cache and programs are held until the
+     *  slot is evicted or sync()/deinit() is called.
+     *
+     *  @param pages    Number of page slots, 0 disables the cache (default)
+     */
+    void set_cache_size(int pages) {
+        cache_pages = pages;
+    }
+
+    /** Get the page cache counters
+     *
+     *  @return         Hits, misses, evictions and write backs since init()
+     */
+    AT45PageCache::Stats get_cache_stats() const {
+        return cache.get_stats();
+    }
+
+    /** Get the device and page cache counters
+     *
+     *  Cheap enough to read from a telemetry thread, build with
+     *  AT45_STATS_ENABLED=1 to count and time the device operations.
+     *
+     *  @return         Device counters since reset_stats(), cache counters since init()
+     */
+    Stats get_stats() {
+        Stats stats;
+
+        at45.get_stats(&stats.device);
+        stats.cache = cache.get_stats();
+
+        return stats;
+    }
+
+    /** Clear the device operation counters
+     */
+    void reset_stats() {
+        at45.reset_stats();
+    }
+
+    /** Format the counters as one line of JSON
+     *
+     *  For collecting benchmark runs and fleet telemetry, latencies are in
+     *  microseconds with p50/p99 taken from the log2 histograms.
+     *
+     *  @param buffer   Buffer for the text
+     *  @param size     Size of the buffer in bytes
+     *  @return         Length of the text, the text is truncated when this is size or more, negative on an encoding error
+     */
+    int format_stats(char *buffer, size_t size) {
+        Stats stats = get_stats();
+        const at45_op_stats_t *op[] = { &stats.device.read, &stats.device.program, &stats.device.erase, &stats.device.status };
+        const char *name[] = { "read", "program", "erase", "status" };
+        int n = snprintf(buffer, size, "{\"pagesize\":%llu,\"pages\":%d", (unsigned long long)pagesize, at45.pages());
+        int r;
+
+        for (int i = 0; (i < 4) && (n >= 0); i++) {
+            size_t used = stats_used(n, size);
+            r = snprintf(buffer + used, size - used,
+                ",\"%s\":{\"count\":%lu,\"bytes\":%lu,\"total_us\":%llu,\"max_us\":%lu,\"p50_us\":%lu,\"p99_us\":%lu}",
+                name[i], (unsigned long)op[i]->count, (unsigned long)op[i]->bytes, (unsigned long long)op[i]->total_us,
+                (unsigned long)op[i]->max_us, (unsigned long)AT45::stats_percentile(op[i], 50),
+                (unsigned long)AT45::stats_percentile(op[i], 99));
+            n = (r < 0) ? r : n + r;
+        }
+
+        if (n < 0) {
+            return n;
+        }
+
+        size_t used = stats_used(n, size);
+        r = snprintf(buffer + used, size - used,
+            ",\"busy\":{\"waits\":%lu,\"polls\":%lu,\"us\":%llu},\"lock\":{\"waits\":%lu,\"us\":%llu}"
+            ",\"power\":{\"sleeps\":%lu,\"wakes\":%lu,\"asleep_us\":%llu}"
+            ",\"cache\":{\"hits\":%lu,\"misses\":%lu,\"evictions\":%lu,\"writebacks\":%lu}}",
+            (unsigned long)stats.device.busy_waits, (unsigned long)stats.device.busy_polls, (unsigned long long)stats.device.busy_us,
+            (unsigned long)stats.device.lock_waits, (unsigned long long)stats.device.lock_us,
+            (unsigned long)stats.device.sleeps, (unsigned long)stats.device.wakes, (unsigned long long)stats.device.asleep_us,
+            (unsigned long)stats.cache.hits, (unsigned long)stats.cache.misses,
+            (unsigned long)stats.cache.evictions, (unsigned long)stats.cache.writebacks);
+
+        return (r < 0) ? r : n + r;
+    }
+
+    /** Power the chip down after a time without requests
+     *
+     *  Once no request has come in for timeout_ms, the chip is put in deep
+     *  or ultra-deep power down from the shared event queue. The next
+     *  request wakes it, and the wake up time runs while the request is
+     *  being set up rather than in front of its first command. Ultra-deep
+     *  power down draws less but loses the SRAM buffers, so the next
+     *  partial program or read reloads its page.
+     *
+     *  @param timeout_ms   Idle time before powering down, 0 to stay awake (default)
+     *  @param mode         Deep or ultra-deep power down
+     *  @return             0 on success, BD_ERROR_DEVICE_ERROR without the event queue
+     */
+    int set_idle_power_down(uint32_t timeout_ms, AT45::PowerDown mode = AT45::POWER_DOWN_DEEP) {
+#if MBED_CONF_EVENTS_PRESENT
+        mutex.lock();
+        idle_timeout = timeout_ms;
+        idle_mode = mode;
+        if (!idle_timeout) {
+            cancel_idle();
+        }
+        mutex.unlock();
+
+        return BD_ERROR_OK;
+#else
+        idle_timeout = 0;
+        idle_mode = mode;
+
+        return timeout_ms ? BD_ERROR_DEVICE_ERROR : BD_ERROR_OK;
+#endif
+    }
+
+    /** Select how erase() and program() erase pages
+     *
+     *  Every page program normally erases the page itself (0x83). In
+     *  ERASE_AUTO mode erase() does not touch the flash at all, in
+     *  ERASE_PRE_ERASED mode program() relies on erase() and programs
+     *  without built-in erase (0x88), which roughly halves program time.
+     *
+     *  @param mode     Erase mode
+     */
+    void set_erase_mode(EraseMode mode) {
+        erase_mode = mode;
+    }
+
+    /** Expose 2^N sized blocks on a device with DataFlash page sizes
+     *
+     *  A 528 byte page is seen as a 512 byte block, without reconfiguring
+     *  the device. The remaining bytes of each page are a spare area that
+     *  program() leaves erased. Call this before init().
+     *
+     *  @param enable   True for the binary view, false for whole pages (default)
+     *  @return         0 on success or a negative error code on failure
+     */
+    int set_binary_view(bool enable) {
+        binary_view = enable;
+
+        if (at45.pages() <= 0) {
+            return BD_ERROR_OK; // applied once init() has read the geometry
+        }
+
+        if (at45.set_binary_view(enable) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        geometry();
+
+        return BD_ERROR_OK;
+    }
+
+    /** Get the spare bytes per page of the binary view
+     *
+     *  @return         8, 16 or 32 with the binary view on a DataFlash page size, 0 otherwise
+     */
+    bd_size_t get_spare_size() const {
+        return sparesize;
+    }
+
+    /** Keep a CRC32 of every block in the spare bytes of the binary view
+     *
+     *  program() stores the CRC and a sequence number with each page, read()
+     *  fails with AT45_CRC_MISMATCH when a page it reads entirely does not
+     *  match. Needs set_binary_view(true) on a DataFlash page size. The first
+     *  program() after turning the checks on reads the spare bytes of every
+     *  page so the sequence numbers carry on from the highest one on the
+     *  device, init() and read() do not wait for that scan.
+     *
+     *  @param enable   True to store and check the CRCs, false to leave the spare bytes erased (default)
+     *  @return         0 on success or a negative error code on failure
+     */
+    int set_integrity(bool enable) {
+        integrity = enable;
+
+        if (!active) {
+            return BD_ERROR_OK; // applied by init(), once the device answers
+        }
+
+        Access access(this);
+
+        if (at45.set_integrity(enable) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    /** Digest of the stored CRCs of a range of blocks
+     *
+     *  Reads only the spare bytes of each page, so checking a firmware image
+     *  against a known digest does not read the image itself.
+     *
+     *  @param addr     Address of the first block, must be a multiple of the erase size
+     *  @param size     Size of the range in bytes, must be a multiple of the erase size
+     *  @param digest   Receives the CRC32 over the CRCs of the pages in the range
+     *  @return         0 on success, AT45_CRC_MISMATCH when a page carries no CRC or a negative error code on failure
+     */
+    int verify(bd_addr_t addr, bd_size_t size, uint32_t *digest) {
+        Access access(this);
+
+        MBED_ASSERT(is_valid_erase(addr, size));
+
+        int r = at45.spare_digest(addr / pagesize, size / pagesize, digest);
+        if (r == -1) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        return r;
+    }
+
+    /** Verify every page program on the chip
+     *
+     *  Each page is uploaded once, programmed and compared against the SRAM
+     *  buffer it was programmed from (0x60/0x61), so the check costs a
+     *  status read instead of reading the page back. program() fails with
+     *  AT45_VERIFY_MISMATCH when a page did not program correctly.
+     *
+     *  @param enable   True to verify, false to trust the page programs (default)
+     */
+    void set_program_verify(bool enable) {
+        at45.set_program_verify(enable);
+    }
+
+    /** Step the SPI clock up to the highest rate the bus still works at
+     *
+     *  Starting from the current clock, the clock is doubled up to max_hz,
+     *  with max_hz itself as the last step. At each step the JEDEC ID must
+     *  match the one read at the starting clock and a pattern written into
+     *  an SRAM buffer must read back. The highest passing clock is kept.
+     *  Called from init() with MBED_CONF_AT45_SPI_PROBE.
+     *
+     *  @param max_hz   Highest clock to try, in Hz
+     *  @return         The SPI clock in use, in Hz
+     */
+    int probe_frequency(int max_hz) {
+        Access access(this);
+
+        int id = at45.id();
+
+        if ((at45.bus_test() != 0) || ((id & 0xff00) != 0x1f00)) {
+            at45_debug("[AT45] bus fails at %d Hz, not probing\n", frequency);
+            return frequency;
+        }
+
+        int best = frequency;
+        int hz = frequency;
+
+        while (hz < max_hz) {
+            hz = (hz > max_hz / 2) ? max_hz : hz * 2;
+
+            spi.frequency(hz);
+            if ((at45.id() != id) || (at45.bus_test() != 0)) {
+                break;
+            }
+            best = hz;
+        }
+
+        spi.frequency(best);
+        frequency = best;
+
+        return frequency;
+    }
+
+    /** Get the SPI clock
+     *
+     *  @return         The SPI clock requested from the HAL, in Hz
+     */
+    int get_frequency() const {
+        return frequency;
+    }
+
+    /** Allow reads and programs smaller than a page
+     *
+     *  Reads can start at any byte, they go through a continuous array read.
+     *  Programs of part of a page are a read-modify-write through an SRAM
+     *  buffer (or the page cache), the rest of the page keeps its contents.
+     *  Every partial program still programs the whole page.
+     *
+     *  @param program_size Program size in bytes, must divide the page size, 0 for whole pages (default)
+     *  @return             0 on success, BD_ERROR_DEVICE_ERROR for an invalid size
+     */
+    int set_subpage_size(bd_size_t program_size) {
+        if (program_size && (pagesize % program_size)) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        subpage_size = program_size;
+
         return BD_ERROR_OK;
     }
 
@@ -59,25 +495,58 @@ public:
      *  @return         0 on success, negative error code on failure
      */
     virtual int program(const void *a_buffer, bd_addr_t addr, bd_size_t size) {
-        MBED_ASSERT(is_valid_read(addr, size));
+        Access access(this);
 
-        at45_debug("[AT45] write addr=%llu size=%llu\n", addr, size);
+        MBED_ASSERT(is_valid_program(addr, size));
 
-        uint32_t start_page = addr / pagesize;
-        uint32_t end_page = (addr + size) / pagesize;
+        at45_debug("[AT45] write addr=%llu size=%llu\n", addr, size);
 
         const char *buffer = (const char*)a_buffer;
+        bool erase = (erase_mode != ERASE_PRE_ERASED);
+
+        while (size > 0) {
+            uint32_t page = addr / pagesize;
+            uint32_t offset = addr % pagesize;
+            bd_size_t chunk;
+            int r;
+
+            if ((offset == 0) && (size >= pagesize)) {
+                // run of whole pages
+                uint32_t count = size / pagesize;
+                chunk = count * pagesize;
+
+                at45_debug("[AT45] writing pages=%lu..%lu\n", page, page + count);
+
+                if (cache.enabled()) {
+                    r = cache.program(buffer, page, count, erase);
+                } else {
+                    // pipelined over both SRAM buffers
+                    r = at45.write_pages(buffer, page, count, erase);
+                }
+            } else {
+                // part of a page, read-modify-write
+                chunk = pagesize - offset;
+                if (chunk > size) {
+                    chunk = size;
+                }
 
-        for (size_t page = start_page; page < end_page; page++) {
-            at45_debug("[AT45] writing to page=%lu\n", page);
+                at45_debug("[AT45] writing page=%lu offset=%lu size=%llu\n", page, offset, chunk);
+
+                if (cache.enabled()) {
+                    r = cache.program_partial(buffer, page, offset, chunk, erase);
+                } else {
+                    r = at45.write_partial(buffer, page, offset, chunk, erase);
+                }
+            }
 
-            int r = at45.write_page((char*)buffer, page);
             if (r != 0) {
                 at45_debug("[AT45] write failed (%d)\n", r);
                 return r;
             }
 
-            buffer += pagesize;
+            buffer += chunk;
+            addr += chunk;
+            size -= chunk;
         }
 
         return BD_ERROR_OK;
@@ -91,25 +560,127 @@ public:
      *  @return         0 on success, negative error code on failure
      */
     virtual int read(void *a_buffer, bd_addr_t addr, bd_size_t size) {
-        MBED_ASSERT(is_valid_program(addr, size));
+        Access access(this);
 
-        at45_debug("[AT45] read addr=%llu size=%llu\n", addr, size);
+        MBED_ASSERT(is_valid_read(addr, size));
 
-        uint32_t start_page = addr / pagesize;
-        uint32_t end_page = (addr + size) / pagesize;
+        at45_debug("[AT45] read addr=%llu size=%llu\n", addr, size);
 
         char *buffer = (char*)a_buffer;
 
-        for (size_t page = start_page; page < end_page; page++) {
-            at45_debug("[AT45] reading from page=%lu\n", page);
+        if (!cache.enabled()) {
+            // one opcode for the whole range, from an SRAM buffer when one holds the page
+            int r = at45.read_bytes(addr, buffer, size);
 
-            int r = at45.read_page((char*)buffer, page);
             if (r != 0) {
                 at45_debug("[AT45] read failed (%d)\n", r);
                 return r;
             }
 
-            buffer += pagesize;
+            return BD_ERROR_OK;
+        }
+
+        while (size > 0) {
+            uint32_t page = addr / pagesize;
+            uint32_t offset = addr % pagesize;
+            bd_size_t chunk;
+            int r;
+
+            if ((offset == 0) && (size >= pagesize)) {
+                uint32_t count = size / pagesize;
+                chunk = count * pagesize;
+
+                at45_debug("[AT45] reading pages=%lu..%lu\n", page, page + count);
+
+                r = cache.read(buffer, page, count);
+            } else {
+                chunk = pagesize - offset;
+                if (chunk > size) {
+                    chunk = size;
+                }
+
+                at45_debug("[AT45] reading page=%lu offset=%lu size=%llu\n", page, offset, chunk);
+
+                r = cache.read_partial(buffer, page, offset, chunk);
+            }
+
+            if (r != 0) {
+                at45_debug("[AT45] read failed (%d)\n", r);
+                return r;
+            }
+
+            buffer += chunk;
+            addr += chunk;
+            size -= chunk;
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    /** Program blocks from a list of segments
+     *
+     *  Like program(), but the data is gathered from the segments straight
+     *  into the SRAM buffer fill, without staging it in one buffer first.
+     *
+     *  @param iov      Segments of data to write to blocks, in order
+     *  @param count    Number of segments
+     *  @param addr     Address of block to begin writing to
+     *  @return         0 on success, negative error code on failure
+     */
+    int programv(const at45_iovec_t *iov, int count, bd_addr_t addr) {
+        Access access(this);
+
+        bd_size_t size = iovec_size(iov, count);
+        MBED_ASSERT(is_valid_program(addr, size));
+
+        at45_debug("[AT45] writev addr=%llu size=%llu segments=%d\n", addr, size, count);
+
+        bool erase = (erase_mode != ERASE_PRE_ERASED);
+        int r;
+
+        if (!cache.enabled()) {
+            r = at45.write_bytesv(addr, iov, count, erase);
+        } else {
+            r = cache_iovec(iov, count, addr, true);
+        }
+
+        if (r != 0) {
+            at45_debug("[AT45] writev failed (%d)\n", r);
+            return r;
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    /** Read blocks into a list of segments
+     *
+     *  Like read(), but one continuous read is scattered straight into the
+     *  segments.
+     *
+     *  @param iov      Segments to read blocks into, in order
+     *  @param count    Number of segments
+     *  @param addr     Address of block to begin reading from
+     *  @return         0 on success, negative error code on failure
+     */
+    int readv(const at45_iovec_t *iov, int count, bd_addr_t addr) {
+        Access access(this);
+
+        bd_size_t size = iovec_size(iov, count);
+        MBED_ASSERT(is_valid_read(addr, size));
+
+        at45_debug("[AT45] readv addr=%llu size=%llu segments=%d\n", addr, size, count);
+
+        int r;
+
+        if (!cache.enabled()) {
+            r = at45.read_bytesv(addr, iov, count);
+        } else {
+            r = cache_iovec(iov, count, addr, false);
+        }
+
+        if (r != 0) {
+            at45_debug("[AT45] readv failed (%d)\n", r);
+            return r;
         }
 
         return BD_ERROR_OK;
@@ -124,33 +695,129 @@ public:
      *  @return         0 on success, negative error code on failure
      */
     virtual int erase(bd_addr_t addr, bd_size_t size) {
-        MBED_ASSERT(is_valid_erase(addr, size));
+        Access access(this);
 
-        #warning "Erase temporarily disabled in this driver!"
+        MBED_ASSERT(is_valid_erase(addr, size));
 
-        // so this is buggy... write here after actually fails
+        at45_debug("[AT45] erase addr=%llu size=%llu\n", addr, size);
 
-        // at45_debug("[AT45] erase addr=%llu size=%llu\n", addr, size);
+        if (erase_mode == ERASE_AUTO) {
+            // every page program erases its page
+            return BD_ERROR_OK;
+        }
 
-        // uint32_t start_page = addr / pagesize;
-        // uint32_t end_page = (addr + size) / pagesize;
+        uint32_t start_page = addr / pagesize;
+        uint32_t end_page = (addr + size) / pagesize;
 
-        // for (size_t page = start_page; page < end_page; page++) {
-        //     at45_debug("[AT45] erasing page=%lu\n", page);
+        // cached copies are stale once the pages are erased
+        cache.invalidate(start_page, end_page - start_page);
 
-        //     // why is this marked as void??
-        //     at45.page_erase(page);
-        // }
+        // coalesced into sector and block erases where aligned
+        int r = at45.erase_pages(start_page, end_page - start_page);
+        if (r != 0) {
+            at45_debug("[AT45] erase failed (%d)\n", r);
+            return r;
+        }
 
         return BD_ERROR_OK;
     }
 
+    /** Erase a range for a factory reset
+     *
+     *  Erases with sector and block erases, never chip erase, which is
+     *  unreliable on some silicon, and returns once the range is erased.
+     *  Keeps the device to itself for the whole wipe, a 64 Mbit part takes
+     *  tens of seconds.
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @param progress Called with pages done and pages in the range after each erase is issued, returns false to cancel
+     *  @return         0 on success, AT45_WIPE_CANCELLED when cancelled or a negative error code on failure
+     */
+    int wipe(bd_addr_t addr, bd_size_t size, at45_progress_t progress = at45_progress_t()) {
+        Access access(this);
+
+        MBED_ASSERT(is_valid_erase(addr, size));
+
+        at45_debug("[AT45] wipe addr=%llu size=%llu\n", addr, size);
+
+        uint32_t start_page = addr / pagesize;
+        uint32_t count = size / pagesize;
+
+        cache.invalidate(start_page, count);
+
+        int r = at45.wipe(start_page, count, progress);
+        if (r == -1) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        return r;
+    }
+
+    /** Erase a range from the shared event queue
+     *
+     *  Returns right away. Every AT45_WIPE_POLL_MS the event queue checks
+     *  the device without waiting for it and issues the next erase once the
+     *  previous one has completed, so other requests get in between erases,
+     *  and wait for the erase in flight. Do not use the range until the
+     *  wipe has finished. Idle power down is held off meanwhile.
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @param progress Called from the event queue with pages done and pages in the range, done equals the pages in the range once the range is erased, returns false to cancel
+     *  @return         0 on success, BD_ERROR_DEVICE_ERROR without the event queue or while a wipe runs
+     */
+    int wipe_background(bd_addr_t addr, bd_size_t size, at45_progress_t progress = at45_progress_t()) {
+#if MBED_CONF_EVENTS_PRESENT
+        Access access(this);
+
+        MBED_ASSERT(is_valid_erase(addr, size));
+
+        if (wipe_event) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        uint32_t start_page = addr / pagesize;
+        uint32_t count = size / pagesize;
+
+        cache.invalidate(start_page, count);
+
+        if (at45.wipe_start(start_page, count) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        wipe_pages = count;
+        wipe_progress = progress;
+        wipe_event = mbed_event_queue()->call_in(AT45_WIPE_POLL_MS, this, &AT45BlockDevice::wipe_step);
+
+        return wipe_event ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+#else
+        return BD_ERROR_DEVICE_ERROR;
+#endif
+    }
+
+    /** Stop a background wipe, the erase in flight still completes
+     */
+    void wipe_cancel() {
+        mutex.lock();
+        at45.wipe_cancel();
+        mutex.unlock();
+    }
+
+    /** Is a background wipe running
+     *
+     *  @return         True until the last erase issued has completed, after the end of the range or wipe_cancel()
+     */
+    bool is_wiping() const {
+        return wipe_event != 0;
+    }
+
     /** Get the size of a readable block
      *
      *  @return         Size of a readable block in bytes
      */
     virtual bd_size_t get_read_size() const {
-        return pagesize;
+        return subpage_size ? 1 : pagesize;
     }
 
     /** Get the size of a programmable block
@@ -158,7 +825,7 @@ public:
      *  @return         Size of a programmable block in bytes
      */
     virtual bd_size_t get_program_size() const {
-        return pagesize;
+        return subpage_size ? subpage_size : pagesize;
     }
 
     /** Get the size of an erasable block
@@ -169,6 +836,15 @@ public:
         return pagesize;
     }
 
+    /** Get the value of storage when erased
+     *
+     *  @return         The value of storage when erased
+     */
+    virtual int get_erase_value() const {
+        // erase() leaves the contents alone in ERASE_AUTO mode
+        return (erase_mode == ERASE_AUTO) ? -1 : 0xFF;
+    }
+
     /** Get the total size of the underlying device
      *
      *  @return         Size of the underlying device in bytes
@@ -178,10 +854,210 @@ public:
     }
 
 private:
+    friend class AT45WearLevelingBlockDevice; // programs whole pages with their spare bytes
+    friend class AT45LogWriter;               // appends through the SRAM buffers
+
+    // held for the duration of each operation, keeps the idle power down away from the chip
+    class Access {
+    public:
+        Access(AT45BlockDevice *bd) : bd(bd) {
+            bd->mutex.lock();
+            bd->at45.wake(); // returns right away, the first command waits for the rest of the wake up
+        }
+
+        ~Access() {
+            bd->last_access = us_ticker_read();
+            bd->schedule_idle();
+            bd->mutex.unlock();
+        }
+
+    private:
+        AT45BlockDevice *bd;
+    };
+
+    // bytes of the stats text in the buffer, the rest of the text goes after them
+    static size_t stats_used(int n, size_t size) {
+        return ((size_t)n < size) ? (size_t)n : size;
+    }
+
+    void schedule_idle() {
+#if MBED_CONF_EVENTS_PRESENT
+        if (active && idle_timeout && !idle_event && !wipe_event && at45.is_it_awake()) {
+            idle_event = mbed_event_queue()->call_in(idle_timeout, this, &AT45BlockDevice::idle);
+        }
+#endif
+    }
+
+    void cancel_idle() {
+#if MBED_CONF_EVENTS_PRESENT
+        if (idle_event) {
+            mbed_event_queue()->cancel(idle_event);
+            idle_event = 0;
+        }
+#endif
+    }
+
+    // runs from the shared event queue
+    void idle() {
+        mutex.lock();
+        idle_event = 0;
+
+        if (active && idle_timeout && !wipe_event && at45.is_it_awake()) {
+            uint32_t idle_ms = (us_ticker_read() - last_access) / 1000;
+
+            if (idle_ms >= idle_timeout) {
+                at45.power_down(idle_mode);
+            } else {
+                schedule_idle(); // a request came in since this was scheduled
+            }
+        }
+
+        mutex.unlock();
+    }
+
+    void cancel_wipe() {
+#if MBED_CONF_EVENTS_PRESENT
+        if (wipe_event) {
+            mbed_event_queue()->cancel(wipe_event);
+            wipe_event = 0;
+        }
+#endif
+        at45.wipe_cancel();
+    }
+
+    // runs from the shared event queue, one erase at a time
+    void wipe_step() {
+        Access access(this);
+
+        int done;
+        int r = at45.wipe_poll(&done);
+
+        if (r == 0) {
+            wipe_event = 0; // lets the idle power down in again
+            if (wipe_progress) {
+                wipe_progress(done, wipe_pages);
+            }
+            return;
+        }
+
+        if (wipe_progress && !wipe_progress(done, wipe_pages)) {
+            at45.wipe_cancel(); // polled on until the erase in flight completes
+        }
+
+#if MBED_CONF_EVENTS_PRESENT
+        wipe_event = mbed_event_queue()->call_in(AT45_WIPE_POLL_MS, this, &AT45BlockDevice::wipe_step);
+#endif
+    }
+
+    // read the geometry, then apply the settings made before it was known
+    int detect() {
+        uint32_t start = us_ticker_read();
+
+        while (at45.probe() != 0) {
+            if ((us_ticker_read() - start) >= MBED_CONF_AT45_DETECT_TIMEOUT_US) {
+                at45_debug("[AT45] no device found\n");
+                return BD_ERROR_DEVICE_ERROR;
+            }
+
+            // a chip in deep power down ignores the ID read
+            at45.deep_power_down(false);
+            wait_us(AT45_DETECT_INTERVAL_US);
+        }
+
+        if (at45.set_binary_view(binary_view) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        geometry();
+
+        if (subpage_size && (pagesize % subpage_size)) {
+            return BD_ERROR_DEVICE_ERROR; // set_subpage_size() could not check it
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    void geometry() {
+        if (at45.pages() <= 0) {
+            pagesize = 0;
+            totalsize = 0;
+            sparesize = 0;
+            return;
+        }
+
+        pagesize = at45.pagesize();
+        totalsize = pagesize * at45.pages();
+        sparesize = at45.sparesize();
+    }
+
+    bd_size_t iovec_size(const at45_iovec_t *iov, int count) const {
+        bd_size_t size = 0;
+        for (int i = 0; i < count; i++) {
+            size += iov[i].length;
+        }
+        return size;
+    }
+
+    // the cache takes one contiguous piece of a page at a time
+    int cache_iovec(const at45_iovec_t *iov, int count, bd_addr_t addr, bool program) {
+        bool erase = (erase_mode != ERASE_PRE_ERASED);
+
+        for (int i = 0; i < count; i++) {
+            char *data = (char*)iov[i].base;
+            bd_size_t size = iov[i].length;
+
+            while (size > 0) {
+                uint32_t page = addr / pagesize;
+                uint32_t offset = addr % pagesize;
+                bd_size_t chunk = pagesize - offset;
+                int r;
+
+                if (chunk > size) {
+                    chunk = size;
+                }
+
+                if (chunk == pagesize) {
+                    r = program ? cache.program(data, page, 1, erase) : cache.read(data, page, 1);
+                } else if (program) {
+                    r = cache.program_partial(data, page, offset, chunk, erase);
+                } else {
+                    r = cache.read_partial(data, page, offset, chunk);
+                }
+
+                if (r != 0) {
+                    return r;
+                }
+
+                data += chunk;
+                addr += chunk;
+                size -= chunk;
+            }
+        }
+
+        return 0;
+    }
+
     DestructableSPI  spi;
     AT45 at45;
+    AT45PageCache cache;
+    int cache_pages;
+    int frequency;
+    bd_size_t subpage_size;
     bd_size_t pagesize;
+    bd_size_t sparesize;
     bd_size_t totalsize;
+    bool binary_view;
+    bool integrity;
+    bool active;                // between init() and deinit()
+    int idle_event;             // pending idle check on the shared event queue, 0 when none
+    uint32_t idle_timeout;      // ms without requests before powering down, 0 to stay awake
+    uint32_t last_access;       // us ticker at the end of the last request
+    AT45::PowerDown idle_mode;
+    int wipe_event;             // pending step of a background wipe on the shared event queue, 0 when none
+    int wipe_pages;             // pages in the range of the background wipe
+    at45_progress_t wipe_progress;
+    PlatformMutex mutex;        // held by each request, and by the idle power down
+    EraseMode erase_mode;
 };
 
 #endif // _FRAGMENTATION_FLASH_AT45_H_
@@ -0,0 +1,48 @@
+#ifndef AT45_CONFIG_H
+#define AT45_CONFIG_H
+
+// Defaults of the at45 configuration shared by the block devices, mbed_lib.json sets them in an mbed build
+
+#if !defined(AT45_BLOCK_DEVICE_DEBUG)
+#define at45_debug(...) do {} while(0)
+#else
+#define at45_debug(...) printf(__VA_ARGS__)
+#endif
+
+#if !defined(MBED_CONF_AT45_SPI_FREQUENCY)
+#define MBED_CONF_AT45_SPI_FREQUENCY    1000000     // SPI clock in Hz
+#endif
+
+#if !defined(MBED_CONF_AT45_SPI_MODE)
+#define MBED_CONF_AT45_SPI_MODE         0           // SPI mode, the AT45 takes mode 0 and 3
+#endif
+
+#if !defined(MBED_CONF_AT45_SPI_PROBE)
+#define MBED_CONF_AT45_SPI_PROBE        0           // step the clock up in init()
+#endif
+
+#if !defined(MBED_CONF_AT45_SPI_PROBE_MAX)
+#define MBED_CONF_AT45_SPI_PROBE_MAX    66000000    // highest clock tried by the probe, in Hz
+#endif
+
+#if !defined(MBED_CONF_AT45_DETECT_TIMEOUT_US)
+#define MBED_CONF_AT45_DETECT_TIMEOUT_US    20000   // time init() gives the device to answer, in us
+#endif
+
+#if !defined(MBED_CONF_AT45_IDLE_TIMEOUT_MS)
+#define MBED_CONF_AT45_IDLE_TIMEOUT_MS      0       // power down after this long without requests, 0 to stay awake
+#endif
+
+#if !defined(MBED_CONF_AT45_IDLE_ULTRA_DEEP)
+#define MBED_CONF_AT45_IDLE_ULTRA_DEEP      0       // ultra-deep rather than deep power down when idle
+#endif
+
+#if !defined(AT45_WIPE_POLL_MS)
+#define AT45_WIPE_POLL_MS               10          // between steps of a background wipe
+#endif
+
+#if !defined(AT45_DETECT_INTERVAL_US)
+#define AT45_DETECT_INTERVAL_US         1000        // between attempts to read the ID
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+#include "mbed.h"
+#include "AT45LogWriter.h"
+
+AT45LogWriter::AT45LogWriter(AT45BlockDevice *bd, bd_addr_t start, bd_size_t size)
+    : _bd(bd), _start(start), _size(size), _pos(0), _buffer(0), _pending(false), _padded(false)
+{
+}
+
+AT45LogWriter::~AT45LogWriter()
+{
+    if (_buffer) {
+        AT45BlockDevice::Access access(_bd);
+        _bd->at45.buffer_reserve(0);
+    }
+}
+
+int AT45LogWriter::append(const void *data, bd_size_t size)
+{
+    AT45BlockDevice::Access access(_bd);
+
+    if (!_valid(size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    AT45 *at45 = &_bd->at45;
+    const char *bytes = (const char*)data;
+
+    while (size > 0) {
+        bd_size_t offset = _pos % _bd->pagesize;
+        bd_size_t chunk = _bd->pagesize - offset;
+
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        if (!_buffer) {
+            // fill the buffer that is not programming, the previous page programs meanwhile
+            _buffer = (at45->program_buffer() == 1) ? 2 : 1;
+            _padded = false;
+
+            // reads and programs through the device keep out of it until the page is programmed
+            at45->buffer_reserve(_buffer);
+        }
+
+        int r = at45->buffer_write(_buffer, offset, bytes, chunk);
+        if (r != 0) {
+            return r;
+        }
+
+        _pending = true;
+        _pos += chunk;
+        bytes += chunk;
+        size -= chunk;
+
+        if (offset + chunk == _bd->pagesize) {
+            r = at45->buffer_program(_buffer, _page() - 1, true);
+            _pending = false;
+            _buffer = 0;
+            at45->buffer_reserve(0);
+
+            if (r != 0) {
+                return r;
+            }
+        }
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45LogWriter::flush()
+{
+    AT45BlockDevice::Access access(_bd);
+
+    if (!_pending) {
+        return BD_ERROR_OK;
+    }
+
+    AT45 *at45 = &_bd->at45;
+
+    if (!_padded) {
+        // the buffer still holds whatever the last page left after the appended bytes
+        static const char erased[32] = {
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+        };
+        int offset = _pos % _bd->pagesize;
+
+        while (offset < (int)_bd->pagesize) {
+            int chunk = _bd->pagesize - offset;
+
+            if (chunk > (int)sizeof(erased)) {
+                chunk = sizeof(erased);
+            }
+
+            int r = at45->buffer_write(_buffer, offset, erased, chunk);
+            if (r != 0) {
+                return r;
+            }
+
+            offset += chunk;
+        }
+
+        _padded = true;
+    }
+
+    _pending = false;
+
+    return at45->buffer_program(_buffer, _page(), true);
+}
+
+int AT45LogWriter::sync()
+{
+    int r = flush();
+    if (r != 0) {
+        return r;
+    }
+
+    return _bd->sync();
+}
+
+int AT45LogWriter::seek(bd_size_t offset)
+{
+    AT45BlockDevice::Access access(_bd);
+
+    if (!_valid(0) || (offset > _size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _pos = offset;
+    _pending = false;
+    _buffer = 0;
+    _bd->at45.buffer_reserve(0);
+
+    if (_pos % _bd->pagesize) {
+        // appends go on in the buffer holding the page
+        int buffer = _bd->at45.buffer_load(_page());
+        if (buffer < 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        _buffer = buffer;
+        _padded = true;
+        _bd->at45.buffer_reserve(_buffer);
+    }
+
+    return BD_ERROR_OK;
+}
+
+bd_size_t AT45LogWriter::tell() const
+{
+    return _pos;
+}
+
+bd_size_t AT45LogWriter::size() const
+{
+    return _size;
+}
+
+// Is the block device initialized, the range page aligned and is there room for size more bytes
+bool AT45LogWriter::_valid(bd_size_t size) const
+{
+    bd_size_t pagesize = _bd->pagesize;
+
+    return pagesize && !(_start % pagesize) && !(_size % pagesize) &&
+           (_start + _size <= _bd->totalsize) && (_pos + size <= _size);
+}
+
+// Page of the next append
+int AT45LogWriter::_page() const
+{
+    return (_start + _pos) / _bd->pagesize;
+}
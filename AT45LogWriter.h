@@ -0,0 +1,94 @@
+#ifndef AT45_LOG_WRITER_H
+#define AT45_LOG_WRITER_H
+
+#include "mbed.h"
+#include "AT45BlockDevice.h"
+
+/** Append-only log in a range of an AT45BlockDevice
+ *
+ *  Records are written straight into an SRAM buffer of the chip at an
+ *  increasing offset, so no page is assembled in RAM. A page is programmed
+ *  once it is full, with built-in erase, and the next page is filled in the
+ *  other SRAM buffer while it programs. flush() programs a partly filled
+ *  page, appends continue in the same page and program it again once it is
+ *  full or flushed again.
+ *
+ *  The SRAM buffer of the page being filled is reserved on the chip
+ *  (AT45::buffer_reserve) until the page is full, so reads and programs
+ *  through the block device use the other buffer in between. Ultra-deep
+ *  power down still drops the bytes appended since the last flush(), and
+ *  bytes not flushed are lost on reset. Other programs of the page being
+ *  filled are overwritten by the next flush().
+ */
+class AT45LogWriter {
+public:
+    /** Create a log in a range of a block device
+     *
+     *  @param bd       The block device, initialized before the first append
+     *  @param start    First byte of the log, must be a multiple of the erase size
+     *  @param size     Size of the log in bytes, must be a multiple of the erase size
+     */
+    AT45LogWriter(AT45BlockDevice *bd, bd_addr_t start, bd_size_t size);
+
+    /** Release the SRAM buffer of the page being filled, bytes not flushed are dropped
+     */
+    ~AT45LogWriter();
+
+    /** Append bytes to the log
+     *
+     *  @param data     Bytes to append
+     *  @param size     Number of bytes
+     *  @return         0 on success, BD_ERROR_DEVICE_ERROR when the log is full, or a negative error code on failure
+     */
+    int append(const void *data, bd_size_t size);
+
+    /** Program the partly filled page
+     *
+     *  The rest of the page is left erased.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int flush();
+
+    /** Program the partly filled page and wait for the page program
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int sync();
+
+    /** Continue the log at an offset, such as the end of a log found after a reset
+     *
+     *  Bytes appended since the last flush() are dropped. The page holding the
+     *  offset is loaded into an SRAM buffer and keeps its contents before it.
+     *
+     *  @param offset   Offset from the start of the log
+     *  @return         0 on success or a negative error code on failure
+     */
+    int seek(bd_size_t offset);
+
+    /** Get the offset the next append goes to
+     *
+     *  @return         Bytes appended from the start of the log
+     */
+    bd_size_t tell() const;
+
+    /** Get the size of the log
+     *
+     *  @return         Size of the log in bytes
+     */
+    bd_size_t size() const;
+
+private:
+    AT45BlockDevice *_bd;
+    bd_addr_t _start;
+    bd_size_t _size;
+    bd_size_t _pos;     // offset of the next append
+    int _buffer;        // SRAM buffer holding the page being filled, 0 before its first byte
+    bool _pending;      // the page has bytes that are not programmed yet
+    bool _padded;       // the buffer holds the erased value, or the page contents, after the last byte
+
+    bool _valid(bd_size_t size) const;
+    int _page(void) const;
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include "mbed.h"
+#include "AT45MultiBlockDevice.h"
+
+AT45MultiBlockDevice::AT45MultiBlockDevice(PinName mosi, PinName miso, PinName sck, const PinName *ncs, int count,
+                                           Layout layout, int hz, int mode)
+    : _spi(mosi, miso, sck), _count(count), _layout(layout), _pages(0), _pagesize(0)
+{
+    MBED_ASSERT((count > 0) && (count <= AT45_MULTI_MAX_CHIPS));
+
+    _spi.format(8, mode);
+    _spi.frequency(hz);
+
+    for (int i = 0; i < AT45_MULTI_MAX_CHIPS; i++) {
+        _chips[i] = (i < _count) ? new AT45(&_spi, ncs[i], AT45::PART_UNKNOWN, false) : NULL;
+    }
+}
+
+AT45MultiBlockDevice::~AT45MultiBlockDevice()
+{
+    for (int i = 0; i < _count; i++) {
+        delete _chips[i];
+    }
+}
+
+int AT45MultiBlockDevice::init()
+{
+    _mutex.lock();
+
+    _spi.init(); // deinit() released it
+
+    int r = BD_ERROR_OK;
+
+    for (int i = 0; (i < _count) && (r == BD_ERROR_OK); i++) {
+        if (_chips[i]->pages() <= 0) {
+            r = _detect(_chips[i]);
+        }
+
+        if ((r == BD_ERROR_OK) && ((_chips[i]->pages() != _chips[0]->pages()) ||
+                                   (_chips[i]->pagesize() != _chips[0]->pagesize()))) {
+            at45_debug("[AT45] chip %d differs from chip 0\n", i);
+            r = BD_ERROR_DEVICE_ERROR;
+        }
+    }
+
+    if (r == BD_ERROR_OK) {
+        _pages = _chips[0]->pages();
+        _pagesize = _chips[0]->pagesize();
+    }
+
+    _mutex.unlock();
+
+    return r;
+}
+
+int AT45MultiBlockDevice::deinit()
+{
+    _mutex.lock();
+
+    for (int i = 0; i < _count; i++) {
+        _chips[i]->busy();
+    }
+    _spi.free();
+
+    _mutex.unlock();
+
+    return BD_ERROR_OK;
+}
+
+int AT45MultiBlockDevice::sync()
+{
+    _mutex.lock();
+
+    for (int i = 0; i < _count; i++) {
+        _chips[i]->busy();
+    }
+
+    _mutex.unlock();
+
+    return BD_ERROR_OK;
+}
+
+int AT45MultiBlockDevice::read(void *a_buffer, bd_addr_t addr, bd_size_t size)
+{
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    at45_debug("[AT45] multi read addr=%llu size=%llu\n", addr, size);
+
+    char *buffer = (char*)a_buffer;
+    int r = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    while ((size > 0) && (r == BD_ERROR_OK)) {
+        uint32_t page;
+        AT45 *at45 = _locate(addr / _pagesize, &page);
+        bd_size_t chunk = _pagesize;
+
+        if (_layout == LAYOUT_CONCAT) {
+            // one continuous read up to the end of the chip
+            chunk = (bd_size_t)(_pages - page) * _pagesize;
+            if (chunk > size) {
+                chunk = size;
+            }
+        }
+
+        // a chip still programming is waited for by its own read
+        r = at45->read_bytes(page * _pagesize, buffer, chunk);
+
+        buffer += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    _mutex.unlock();
+
+    return (r == 0) ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+}
+
+int AT45MultiBlockDevice::program(const void *a_buffer, bd_addr_t addr, bd_size_t size)
+{
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    at45_debug("[AT45] multi write addr=%llu size=%llu\n", addr, size);
+
+    const char *buffer = (const char*)a_buffer;
+    int r = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    while ((size > 0) && (r == BD_ERROR_OK)) {
+        uint32_t page;
+        AT45 *at45 = _locate(addr / _pagesize, &page);
+        uint32_t count = 1;
+
+        if (_layout == LAYOUT_CONCAT) {
+            // pipelined over both SRAM buffers, up to the end of the chip
+            count = _pages - page;
+            if (count > size / _pagesize) {
+                count = size / _pagesize;
+            }
+        }
+
+        // returns once the page program is issued, the next chip fills its buffer meanwhile
+        r = at45->write_pages(buffer, page, count, true);
+
+        buffer += count * _pagesize;
+        addr += count * _pagesize;
+        size -= count * _pagesize;
+    }
+
+    _mutex.unlock();
+
+    if (r != 0) {
+        at45_debug("[AT45] multi write failed (%d)\n", r);
+        return (r == -1) ? BD_ERROR_DEVICE_ERROR : r;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45MultiBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    at45_debug("[AT45] multi erase addr=%llu size=%llu\n", addr, size);
+
+    uint32_t start = addr / _pagesize;
+    uint32_t end = (addr + size) / _pagesize;
+    int pages[AT45_MULTI_MAX_CHIPS];
+    int r = 0;
+
+    _mutex.lock();
+
+    for (int i = 0; (i < _count) && (r == 0); i++) {
+        uint32_t first;
+        uint32_t last;
+
+        if (_layout == LAYOUT_STRIPE) {
+            // pages i, i + n, i + 2n ... of the device, consecutive on the chip
+            first = (start + _count - 1 - i) / _count;
+            last = (end + _count - 1 - i) / _count;
+        } else {
+            first = (start > (uint32_t)(i * _pages)) ? start - i * _pages : 0;
+            last = (end > (uint32_t)(i * _pages)) ? end - i * _pages : 0;
+
+            if (first > (uint32_t)_pages) {
+                first = _pages;
+            }
+            if (last > (uint32_t)_pages) {
+                last = _pages;
+            }
+        }
+
+        pages[i] = last - first;
+        r = _chips[i]->wipe_start(first, pages[i]);
+    }
+
+    // round robin, each chip gets its next sector or block erase once its last one completes,
+    // returns once the last erases are issued like AT45::erase_pages
+    bool issuing = (r == 0);
+
+    while (issuing) {
+        issuing = false;
+
+        for (int i = 0; i < _count; i++) {
+            int done;
+
+            _chips[i]->wipe_poll(&done);
+            if (done < pages[i]) {
+                issuing = true;
+            }
+        }
+
+        if (issuing) {
+            // a sector or block erase takes tens of ms, leave the CPU to other threads meanwhile
+#if MBED_CONF_RTOS_PRESENT
+            ThisThread::sleep_for(AT45_MULTI_ERASE_POLL_MS);
+#else
+            wait_us(AT45_MULTI_ERASE_POLL_MS * 1000);
+#endif
+        }
+    }
+
+    if (r != 0) {
+        for (int i = 0; i < _count; i++) {
+            _chips[i]->wipe_cancel();
+        }
+    }
+
+    _mutex.unlock();
+
+    return (r == 0) ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+}
+
+bd_size_t AT45MultiBlockDevice::get_read_size() const
+{
+    return _pagesize;
+}
+
+bd_size_t AT45MultiBlockDevice::get_program_size() const
+{
+    return _pagesize;
+}
+
+bd_size_t AT45MultiBlockDevice::get_erase_size() const
+{
+    return _pagesize;
+}
+
+int AT45MultiBlockDevice::get_erase_value() const
+{
+    return 0xFF;
+}
+
+bd_size_t AT45MultiBlockDevice::size() const
+{
+    return _pagesize * _pages * _count;
+}
+
+AT45 *AT45MultiBlockDevice::get_chip(int chip)
+{
+    return ((chip >= 0) && (chip < _count)) ? _chips[chip] : NULL;
+}
+
+// read the geometry, retrying while the chip powers up
+int AT45MultiBlockDevice::_detect(AT45 *at45)
+{
+    uint32_t start = us_ticker_read();
+
+    while (at45->probe() != 0) {
+        if ((us_ticker_read() - start) >= MBED_CONF_AT45_DETECT_TIMEOUT_US) {
+            at45_debug("[AT45] no device found\n");
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        // a chip in deep power down ignores the ID read
+        at45->deep_power_down(false);
+        wait_us(AT45_DETECT_INTERVAL_US);
+    }
+
+    return BD_ERROR_OK;
+}
+
+// chip holding a page of the device, and the page on the chip
+AT45 *AT45MultiBlockDevice::_locate(uint32_t page, uint32_t *chip_page)
+{
+    if (_layout == LAYOUT_STRIPE) {
+        *chip_page = page / _count;
+        return _chips[page % _count];
+    }
+
+    *chip_page = page % _pages;
+    return _chips[page / _pages];
+}
@@ -0,0 +1,169 @@
+#ifndef AT45_MULTI_BLOCK_DEVICE_H
+#define AT45_MULTI_BLOCK_DEVICE_H
+
+#include "mbed.h"
+#include "DestructableSPI.h"
+#include "BlockDevice.h"
+#include "AT45.h"
+#include "AT45Config.h"
+
+#if !defined(AT45_MULTI_MAX_CHIPS)
+#define AT45_MULTI_MAX_CHIPS    4       // chips on one bus
+#endif
+
+#if !defined(AT45_MULTI_ERASE_POLL_MS)
+#define AT45_MULTI_ERASE_POLL_MS    1   // between status rounds of erase(), other threads run meanwhile
+#endif
+
+/** Block device over several AT45 chips on one SPI bus
+ *
+ *  The chips share SCK/MOSI/MISO and one SPI interface, each has its own
+ *  chip select. They must be the same part with the same page size.
+ *
+ *  With LAYOUT_STRIPE consecutive pages go to consecutive chips. A page
+ *  program returns as soon as it has been issued, so the SPI bus fills
+ *  the SRAM buffer of the next chip while the previous ones program, and
+ *  runs of pages program close to N times as fast as on one chip. With
+ *  LAYOUT_CONCAT the chips follow each other, for capacity.
+ *
+ *  Reads, programs and erases are whole pages, every program erases its
+ *  page itself.
+ */
+class AT45MultiBlockDevice : public BlockDevice {
+public:
+
+    /** How pages are spread over the chips
+     */
+    enum Layout {
+        LAYOUT_STRIPE,      /**< page n is on chip n % chips */
+        LAYOUT_CONCAT       /**< the pages of chip 0 come first, then those of chip 1 and so on */
+    };
+
+    /** Create a block device over the chips on one bus
+     *
+     *  The geometry is read from the chips in init(), the constructor does
+     *  not talk to them.
+     *
+     *  @param mosi     SPI MOSI pin
+     *  @param miso     SPI MISO pin
+     *  @param sck      SPI SCK pin
+     *  @param ncs      Chip select pins, one per chip
+     *  @param count    Number of chips, up to AT45_MULTI_MAX_CHIPS
+     *  @param layout   Stripe or concatenate
+     *  @param hz       SPI clock in Hz
+     *  @param mode     SPI mode, 0 or 3
+     */
+    AT45MultiBlockDevice(PinName mosi, PinName miso, PinName sck, const PinName *ncs, int count,
+                         Layout layout = LAYOUT_STRIPE,
+                         int hz = MBED_CONF_AT45_SPI_FREQUENCY, int mode = MBED_CONF_AT45_SPI_MODE);
+
+    virtual ~AT45MultiBlockDevice();
+
+    /** Initialize the block device
+     *
+     *  Reads the geometry from every chip, retrying for up to
+     *  MBED_CONF_AT45_DETECT_TIMEOUT_US while they power up. After deinit()
+     *  the SPI interface is set up again.
+     *
+     *  @return         0 on success, BD_ERROR_DEVICE_ERROR when a chip does not answer or differs from chip 0
+     */
+    virtual int init();
+
+    /** Deinitialize the block device
+     *
+     *  Waits for the page programs of all chips before releasing the SPI interface
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  Waits for the page programs of all chips
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the block device
+     *
+     *  @param buffer   Buffer to read blocks into
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to the block device
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks on the block device
+     *
+     *  The chips erase their share of the range at the same time: the next
+     *  sector or block erase of each chip is issued once the chip has
+     *  completed its previous one. The status of the chips is read every
+     *  AT45_MULTI_ERASE_POLL_MS, the thread sleeps in between.
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programmable block
+     *
+     *  @return         Size of a programmable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of an erasable block
+     *
+     *  @return         Size of an erasable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of storage when erased
+     *
+     *  @return         The value of storage when erased
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the total size of all chips
+     *
+     *  @return         Size of the block device in bytes
+     */
+    virtual bd_size_t size() const;
+
+    /** Get one of the chips
+     *
+     *  @param chip     Index of the chip, in the order of the chip select pins
+     *  @return         The chip, or NULL for an invalid index
+     */
+    AT45 *get_chip(int chip);
+
+private:
+    DestructableSPI _spi;
+    AT45 *_chips[AT45_MULTI_MAX_CHIPS];
+    int _count;
+    Layout _layout;
+    int _pages;             // pages per chip
+    bd_size_t _pagesize;
+    PlatformMutex _mutex;
+
+    int _detect(AT45 *at45);
+    AT45 *_locate(uint32_t page, uint32_t *chip_page);
+};
+
+#endif
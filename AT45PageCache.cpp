@@ -0,0 +1,294 @@
+#include "mbed.h"
+#include "AT45PageCache.h"
+
+AT45PageCache::AT45PageCache(AT45* at45)
+    : _at45(at45), _data(NULL), _slot(NULL), _slots(0), _pagesize(0), _clock(0), _erase(true)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+AT45PageCache::~AT45PageCache()
+{
+    deinit();
+}
+
+int AT45PageCache::init(int slots, int pagesize)
+{
+    deinit();
+
+    memset(&_stats, 0, sizeof(_stats));
+
+    if ((slots <= 0) || (pagesize <= 0)) {
+        return 0;
+    }
+
+    _data = (char*)malloc(slots * pagesize);
+    _slot = (slot_t*)malloc(slots * sizeof(slot_t));
+
+    if (!_data || !_slot) {
+        deinit();
+        return AT45_OUT_OF_MEMORY;
+    }
+
+    for (int i = 0; i < slots; i++) {
+        _slot[i].page = -1;
+        _slot[i].dirty = false;
+        _slot[i].used = 0;
+    }
+
+    _slots = slots;
+    _pagesize = pagesize;
+
+    return 0;
+}
+
+void AT45PageCache::deinit()
+{
+    free(_data);
+    free(_slot);
+
+    _data = NULL;
+    _slot = NULL;
+    _slots = 0;
+}
+
+bool AT45PageCache::enabled() const
+{
+    return _slots > 0;
+}
+
+int AT45PageCache::read(char* data, int page, int count)
+{
+    int i = 0;
+
+    while (i < count) {
+        int s = _find(page + i);
+
+        if (s >= 0) {
+            memcpy(&data[i * _pagesize], _slotdata(s), _pagesize);
+            _stats.hits++;
+            i++;
+            continue;
+        }
+
+        // run of pages that are not cached
+        int run = 1;
+        while ((i + run < count) && (_find(page + i + run) < 0)) {
+            run++;
+        }
+        _stats.misses += run;
+
+        if (count == 1) {
+            // single page reads are the hot metadata reads, keep a copy
+            s = _load(page);
+            if (s < 0) {
+                return s;
+            }
+
+            memcpy(data, _slotdata(s), _pagesize);
+        } else {
+            int r = _at45->read_continuous(&data[i * _pagesize], (page + i) * _pagesize, run * _pagesize);
+            if (r != 0) {
+                return r;
+            }
+        }
+
+        i += run;
+    }
+
+    return 0;
+}
+
+int AT45PageCache::program(const char* data, int page, int count, bool erase)
+{
+    _erase = erase;
+
+    if (count > _slots) {
+        // would only thrash the cache, program directly
+        invalidate(page, count);
+        return _at45->write_pages(data, page, count, erase);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int s = _find(page + i);
+
+        if (s >= 0) {
+            _stats.hits++;
+        } else {
+            _stats.misses++;
+
+            s = _allocate(page + i);
+            if (s < 0) {
+                return s;
+            }
+        }
+
+        memcpy(_slotdata(s), &data[i * _pagesize], _pagesize);
+        _slot[s].dirty = true;
+    }
+
+    return 0;
+}
+
+int AT45PageCache::read_partial(char* data, int page, int offset, int length)
+{
+    int s = _find(page);
+
+    if (s >= 0) {
+        _stats.hits++;
+    } else {
+        _stats.misses++;
+
+        s = _load(page);
+        if (s < 0) {
+            return s;
+        }
+    }
+
+    memcpy(data, &_slotdata(s)[offset], length);
+
+    return 0;
+}
+
+int AT45PageCache::program_partial(const char* data, int page, int offset, int length, bool erase)
+{
+    _erase = erase;
+
+    int s = _find(page);
+
+    if (s >= 0) {
+        _stats.hits++;
+    } else {
+        _stats.misses++;
+
+        // the rest of the page has to be written back as it is
+        s = _load(page);
+        if (s < 0) {
+            return s;
+        }
+    }
+
+    memcpy(&_slotdata(s)[offset], data, length);
+    _slot[s].dirty = true;
+
+    return 0;
+}
+
+int AT45PageCache::flush(bool erase)
+{
+    _erase = erase;
+
+    for (int s = 0; s < _slots; s++) {
+        int r = _writeback(s);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+void AT45PageCache::invalidate(int page, int count)
+{
+    for (int s = 0; s < _slots; s++) {
+        if ((_slot[s].page >= page) && (_slot[s].page < page + count)) {
+            _slot[s].page = -1;
+            _slot[s].dirty = false;
+        }
+    }
+}
+
+AT45PageCache::Stats AT45PageCache::get_stats() const
+{
+    return _stats;
+}
+
+// Find the slot holding a page, -1 when not cached
+int AT45PageCache::_find(int page)
+{
+    for (int s = 0; s < _slots; s++) {
+        if (_slot[s].page == page) {
+            _touch(s);
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+// Take a free slot, or the least recently used one, for a page
+int AT45PageCache::_allocate(int page)
+{
+    int victim = 0;
+
+    for (int s = 0; s < _slots; s++) {
+        if (_slot[s].page == -1) {
+            victim = s;
+            break;
+        }
+
+        if ((_clock - _slot[s].used) > (_clock - _slot[victim].used)) {
+            victim = s;
+        }
+    }
+
+    if (_slot[victim].page != -1) {
+        _stats.evictions++;
+
+        int r = _writeback(victim);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    _slot[victim].page = page;
+    _slot[victim].dirty = false;
+    _touch(victim);
+
+    return victim;
+}
+
+// Take a slot for a page and fill it from the flash
+int AT45PageCache::_load(int page)
+{
+    int s = _allocate(page);
+    if (s < 0) {
+        return s;
+    }
+
+    int r = _at45->read_continuous(_slotdata(s), page * _pagesize, _pagesize);
+    if (r != 0) {
+        _slot[s].page = -1;
+        return r;
+    }
+
+    return s;
+}
+
+// Program a dirty slot back to the flash
+int AT45PageCache::_writeback(int slot)
+{
+    if (!_slot[slot].dirty) {
+        return 0;
+    }
+
+    int r = _at45->write_page(_slotdata(slot), _slot[slot].page, _erase);
+    if (r != 0) {
+        return r;
+    }
+
+    _slot[slot].dirty = false;
+    _stats.writebacks++;
+
+    return 0;
+}
+
+void AT45PageCache::_touch(int slot)
+{
+    _slot[slot].used = ++_clock;
+}
+
+char* AT45PageCache::_slotdata(int slot)
+{
+    return &_data[slot * _pagesize];
+}
@@ -0,0 +1,141 @@
+#ifndef AT45_PAGE_CACHE_H
+#define AT45_PAGE_CACHE_H
+
+#include "mbed.h"
+#include "AT45.h"
+
+/** Write-back page cache in front of an AT45
+ *
+ *  Holds a fixed number of whole pages in RAM, allocated once in init().
+ *  Slots are evicted least recently used first, dirty slots are programmed
+ *  back on eviction and on flush().
+ *
+ *  Single page reads are kept in the cache, longer reads are served from
+ *  the cache where possible and read straight into the caller's buffer
+ *  otherwise, so a large sequential read does not flush the hot pages out.
+ */
+class AT45PageCache {
+public:
+    /** Cache counters
+     */
+    struct Stats {
+        uint32_t hits;       /**< page lookups served from RAM */
+        uint32_t misses;     /**< page lookups that went to the flash */
+        uint32_t evictions;  /**< slots reused for another page */
+        uint32_t writebacks; /**< dirty pages programmed back to the flash */
+    };
+
+    /** Create a cache in front of an AT45
+     *
+     *  @param at45 The AT45 the pages are cached from
+     */
+    AT45PageCache(AT45* at45);
+
+    ~AT45PageCache();
+
+    /** Allocate the slots
+     *
+     *  @param slots    Number of page slots, 0 disables the cache
+     *  @param pagesize Page size of the device in bytes
+     *  @return         0 on success, AT45_OUT_OF_MEMORY when the slots can't be allocated
+     */
+    int init(int slots, int pagesize);
+
+    /** Release the slots, dirty pages are dropped so flush() first
+     */
+    void deinit(void);
+
+    /** Is the cache allocated
+     *
+     *  @return True = slots allocated
+     */
+    bool enabled(void) const;
+
+    /** Read whole pages through the cache
+     *
+     *  @param data  Buffer that holds count x page size bytes
+     *  @param page  First page to read
+     *  @param count Number of pages
+     *  @return      0 on success or a negative error code
+     */
+    int read(char* data, int page, int count);
+
+    /** Program whole pages through the cache
+     *
+     *  Programs that don't fit in the cache go to the flash directly.
+     *  @param data  Buffer that holds count x page size bytes
+     *  @param page  First page to program
+     *  @param count Number of pages
+     *  @param erase Program with built-in erase when written back
+     *  @return      0 on success or a negative error code
+     */
+    int program(const char* data, int page, int count, bool erase);
+
+    /** Read part of a page through the cache
+     *
+     *  A miss loads the whole page into a slot.
+     *  @param data   Buffer that holds length bytes
+     *  @param page   Page to read from
+     *  @param offset Offset of the first byte in the page
+     *  @param length Number of bytes, must not cross the end of the page
+     *  @return       0 on success or a negative error code
+     */
+    int read_partial(char* data, int page, int offset, int length);
+
+    /** Program part of a page through the cache
+     *
+     *  A miss loads the whole page into a slot, the bytes are patched in RAM.
+     *  @param data   Buffer that holds length bytes
+     *  @param page   Page to program
+     *  @param offset Offset of the first byte in the page
+     *  @param length Number of bytes, must not cross the end of the page
+     *  @param erase  Program with built-in erase when written back
+     *  @return       0 on success or a negative error code
+     */
+    int program_partial(const char* data, int page, int offset, int length, bool erase);
+
+    /** Program all dirty pages back to the flash
+     *
+     *  @param erase Program with built-in erase
+     *  @return      0 on success or a negative error code
+     */
+    int flush(bool erase);
+
+    /** Drop cached copies of a range of pages, dirty or not
+     *
+     *  @param page  First page
+     *  @param count Number of pages
+     */
+    void invalidate(int page, int count);
+
+    /** Cache counters since init()
+     *
+     *  @return The counters
+     */
+    Stats get_stats(void) const;
+
+private:
+    struct slot_t {
+        int page;      // cached page, -1 when free
+        bool dirty;    // needs to be programmed back
+        uint32_t used; // LRU stamp
+    };
+
+    AT45* _at45;
+    char* _data;       // slots x pagesize bytes
+    slot_t* _slot;
+    int _slots;
+    int _pagesize;
+    uint32_t _clock;   // LRU stamp of the last access
+    bool _erase;       // program mode of the dirty slots
+    Stats _stats;
+
+    int _find(int page);
+    int _allocate(int page);
+    int _load(int page);
+    int _writeback(int slot);
+    void _touch(int slot);
+    char* _slotdata(int slot);
+};
+
+#endif
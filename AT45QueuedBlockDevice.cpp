@@ -0,0 +1,348 @@
+#include "mbed.h"
+#include "AT45QueuedBlockDevice.h"
+
+#if MBED_CONF_RTOS_PRESENT
+
+AT45QueuedBlockDevice::AT45QueuedBlockDevice(AT45BlockDevice *bd, osPriority priority)
+    : _bd(bd), _priority(priority), _thread(NULL), _work(_mutex), _reads(NULL), _writes(NULL),
+      _order(0), _burst(0), _running(false)
+{
+}
+
+AT45QueuedBlockDevice::~AT45QueuedBlockDevice()
+{
+    deinit();
+}
+
+int AT45QueuedBlockDevice::init()
+{
+    if (_thread) {
+        return BD_ERROR_OK;
+    }
+
+    int r = _bd->init();
+    if (r != 0) {
+        return r;
+    }
+
+    _thread = new Thread(_priority, AT45_QUEUE_STACK_SIZE);
+    if (!_thread) {
+        _bd->deinit();
+        return AT45_OUT_OF_MEMORY;
+    }
+
+    _running = true;
+
+    if (_thread->start(callback(this, &AT45QueuedBlockDevice::_worker)) != osOK) {
+        _running = false;
+        delete _thread;
+        _thread = NULL;
+        _bd->deinit();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45QueuedBlockDevice::deinit()
+{
+    if (!_thread) {
+        return BD_ERROR_OK;
+    }
+
+    // the worker serves what is queued, then returns
+    _mutex.lock();
+    _running = false;
+    _work.notify_all();
+    _mutex.unlock();
+
+    _thread->join();
+    delete _thread;
+    _thread = NULL;
+
+    return _bd->deinit();
+}
+
+int AT45QueuedBlockDevice::sync()
+{
+    Request req;
+
+    req.op = OP_SYNC;
+
+    int r = submit(&req);
+    if (r != 0) {
+        return r;
+    }
+
+    return wait(&req);
+}
+
+int AT45QueuedBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    Request req;
+
+    req.op = OP_READ;
+    req.buffer = buffer;
+    req.addr = addr;
+    req.size = size;
+
+    int r = submit(&req);
+    if (r != 0) {
+        return r;
+    }
+
+    return wait(&req);
+}
+
+int AT45QueuedBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    Request req;
+
+    req.op = OP_PROGRAM;
+    req.buffer = (void*)buffer;
+    req.addr = addr;
+    req.size = size;
+
+    int r = submit(&req);
+    if (r != 0) {
+        return r;
+    }
+
+    return wait(&req);
+}
+
+int AT45QueuedBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    Request req;
+
+    req.op = OP_ERASE;
+    req.addr = addr;
+    req.size = size;
+
+    int r = submit(&req);
+    if (r != 0) {
+        return r;
+    }
+
+    return wait(&req);
+}
+
+int AT45QueuedBlockDevice::submit(Request *req)
+{
+    _mutex.lock();
+
+    if (!_running) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    req->next = NULL;
+    req->order = _order++;
+    req->result = 0;
+
+    _append((req->op == OP_READ) ? &_reads : &_writes, req);
+
+    _work.notify_one();
+    _mutex.unlock();
+
+    return BD_ERROR_OK;
+}
+
+int AT45QueuedBlockDevice::wait(Request *req)
+{
+    req->done.wait();
+
+    return req->result;
+}
+
+bd_size_t AT45QueuedBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t AT45QueuedBlockDevice::get_program_size() const
+{
+    return _bd->get_program_size();
+}
+
+bd_size_t AT45QueuedBlockDevice::get_erase_size() const
+{
+    return _bd->get_erase_size();
+}
+
+int AT45QueuedBlockDevice::get_erase_value() const
+{
+    return _bd->get_erase_value();
+}
+
+bd_size_t AT45QueuedBlockDevice::size() const
+{
+    return _bd->size();
+}
+
+void AT45QueuedBlockDevice::_worker()
+{
+    Request *batch[AT45_QUEUE_MERGE_MAX];
+
+    while (true) {
+        int count;
+
+        _mutex.lock();
+        while ((count = _next(batch)) == 0) {
+            if (!_running) {
+                _mutex.unlock();
+                return;
+            }
+
+            _work.wait();
+        }
+        _mutex.unlock();
+
+        // the queues are open to other threads while the device works
+        _serve(batch, count);
+    }
+}
+
+// Take the next requests off the queues, called with the mutex held
+int AT45QueuedBlockDevice::_next(Request **batch)
+{
+    Request *read = NULL;
+
+    if (_reads && (!_writes || (_burst < AT45_QUEUE_READ_BURST))) {
+        // the oldest read that is not waiting for an older program or erase of the same range
+        for (read = _reads; read; read = read->next) {
+            if (!_overlaps(read, _writes, true)) {
+                break;
+            }
+        }
+    }
+
+    if (!read && _writes) {
+        // programs keep their order, the oldest one goes unless it would overtake an older read
+        // of the same range, that read can't be waiting for anything as no older program is queued
+        for (read = _reads; read; read = read->next) {
+            if ((read->order < _writes->order) && _overlap(read, _writes)) {
+                break;
+            }
+        }
+
+        if (!read) {
+            batch[0] = _writes;
+            _unlink(&_writes, _writes);
+            _burst = 0;
+            return 1;
+        }
+    }
+
+    if (!read) {
+        return 0;
+    }
+
+    _unlink(&_reads, read);
+    batch[0] = read;
+
+    // merge queued reads that continue the range into one continuous read
+    int count = 1;
+    bd_addr_t end = read->addr + read->size;
+
+    while (count < AT45_QUEUE_MERGE_MAX) {
+        Request *next;
+
+        for (next = _reads; next; next = next->next) {
+            if ((next->addr == end) && !_overlaps(next, _writes, true)) {
+                break;
+            }
+        }
+
+        if (!next) {
+            break;
+        }
+
+        _unlink(&_reads, next);
+        batch[count++] = next;
+        end += next->size;
+    }
+
+    if (_writes) {
+        _burst++;
+    }
+
+    return count;
+}
+
+void AT45QueuedBlockDevice::_serve(Request **batch, int count)
+{
+    Request *req = batch[0];
+    int r;
+
+    if (count > 1) {
+        at45_iovec_t iov[AT45_QUEUE_MERGE_MAX];
+
+        for (int i = 0; i < count; i++) {
+            iov[i].base = batch[i]->buffer;
+            iov[i].length = batch[i]->size;
+        }
+
+        r = _bd->readv(iov, count, req->addr);
+    } else if (req->op == OP_READ) {
+        r = _bd->read(req->buffer, req->addr, req->size);
+    } else if (req->op == OP_PROGRAM) {
+        r = _bd->program(req->buffer, req->addr, req->size);
+    } else if (req->op == OP_ERASE) {
+        r = _bd->erase(req->addr, req->size);
+    } else {
+        r = _bd->sync();
+    }
+
+    for (int i = 0; i < count; i++) {
+        batch[i]->result = r;
+        batch[i]->done.release();
+    }
+}
+
+// Does a request overlap a request in a queue, only the ones submitted before it when older is set
+bool AT45QueuedBlockDevice::_overlaps(const Request *req, const Request *queue, bool older)
+{
+    for (const Request *q = queue; q; q = q->next) {
+        if (older && (q->order > req->order)) {
+            break; // the queue is in submit order
+        }
+
+        if (_overlap(req, q)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Do two requests touch the same bytes, a sync overlaps everything
+bool AT45QueuedBlockDevice::_overlap(const Request *a, const Request *b)
+{
+    if ((a->op == OP_SYNC) || (b->op == OP_SYNC)) {
+        return true;
+    }
+
+    return (a->addr < b->addr + b->size) && (b->addr < a->addr + a->size);
+}
+
+void AT45QueuedBlockDevice::_unlink(Request **queue, Request *req)
+{
+    while (*queue != req) {
+        queue = &(*queue)->next;
+    }
+
+    *queue = req->next;
+    req->next = NULL;
+}
+
+void AT45QueuedBlockDevice::_append(Request **queue, Request *req)
+{
+    while (*queue) {
+        queue = &(*queue)->next;
+    }
+
+    *queue = req;
+}
+
+#endif
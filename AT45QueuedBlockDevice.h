@@ -0,0 +1,188 @@
+#ifndef AT45_QUEUED_BLOCK_DEVICE_H
+#define AT45_QUEUED_BLOCK_DEVICE_H
+
+#include "mbed.h"
+#include "AT45BlockDevice.h"
+
+#if MBED_CONF_RTOS_PRESENT
+
+#if !defined(AT45_QUEUE_STACK_SIZE)
+#define AT45_QUEUE_STACK_SIZE   2048    // worker thread stack, in bytes
+#endif
+
+#if !defined(AT45_QUEUE_MERGE_MAX)
+#define AT45_QUEUE_MERGE_MAX    8       // adjacent reads served by one continuous read
+#endif
+
+#if !defined(AT45_QUEUE_READ_BURST)
+#define AT45_QUEUE_READ_BURST   8       // reads served in a row while a program or erase is waiting
+#endif
+
+/** Request queue in front of an AT45BlockDevice shared between threads
+ *
+ *  All requests are serviced by one worker thread, so the device and its
+ *  SRAM buffers are only touched by one thread and every command, including
+ *  multi-command sequences such as a read-modify-write, runs to completion
+ *  without being interleaved with another caller.
+ *
+ *  Reads are served before waiting programs and erases, up to
+ *  AT45_QUEUE_READ_BURST in a row, and never overtake an older program or
+ *  erase of the same range. Queued reads of adjacent ranges are merged into
+ *  one continuous read.
+ *
+ *  The BlockDevice functions submit a request and wait for it, submit() and
+ *  wait() let a caller queue a request and collect it later.
+ */
+class AT45QueuedBlockDevice : public BlockDevice {
+public:
+    /** Queued operations
+     */
+    enum Op {
+        OP_READ,
+        OP_PROGRAM,
+        OP_ERASE,
+        OP_SYNC
+    };
+
+    /** One queued request, owned by the caller until wait() returns
+     */
+    struct Request {
+        Op op;              /**< operation */
+        void *buffer;       /**< data to program or buffer to read into */
+        bd_addr_t addr;     /**< first byte of the range */
+        bd_size_t size;     /**< size of the range in bytes */
+        int result;         /**< status once the request is done */
+
+        Request() : op(OP_SYNC), buffer(NULL), addr(0), size(0), result(0), next(NULL), order(0) {}
+
+    private:
+        friend class AT45QueuedBlockDevice;
+
+        Request *next;      // next request in the same queue
+        uint32_t order;     // submit order
+        Semaphore done;     // released by the worker
+    };
+
+    /** Create a request queue in front of a block device
+     *
+     *  @param bd       The block device, only used through the queue from here on
+     *  @param priority Priority of the worker thread
+     */
+    AT45QueuedBlockDevice(AT45BlockDevice *bd, osPriority priority = osPriorityAboveNormal);
+
+    virtual ~AT45QueuedBlockDevice();
+
+    /** Initialize the block device and start the worker
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Serve the queued requests, stop the worker and deinitialize the block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver, after the requests queued before
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the block device, waits for the request
+     *
+     *  @param buffer   Buffer to read blocks into
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to the block device, waits for the request
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks on the block device, waits for the request
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Queue a request without waiting for it
+     *
+     *  The request and its buffer must stay valid until wait() has returned.
+     *
+     *  @param req      Request with op, buffer, addr and size filled in
+     *  @return         0 on success, BD_ERROR_DEVICE_ERROR before init()
+     */
+    int submit(Request *req);
+
+    /** Wait for a submitted request
+     *
+     *  @param req      A request passed to submit()
+     *  @return         The status of the request
+     */
+    int wait(Request *req);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of a eraseable block
+     *
+     *  @return         Size of a eraseable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of storage when erased
+     *
+     *  @return         The value of storage when erased, or -1 if not predictable
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the total size of the underlying device
+     *
+     *  @return         Size of the underlying device in bytes
+     */
+    virtual bd_size_t size() const;
+
+private:
+    AT45BlockDevice *_bd;
+    osPriority _priority;
+    Thread *_thread;
+    Mutex _mutex;              // protects the queues
+    ConditionVariable _work;   // signalled when a request is queued
+    Request *_reads;           // queued reads, in submit order
+    Request *_writes;          // queued programs, erases and syncs, in submit order
+    uint32_t _order;           // submit order of the next request
+    int _burst;                // reads served in a row while a write is waiting
+    bool _running;
+
+    void _worker(void);
+    int _next(Request **batch);
+    void _serve(Request **batch, int count);
+    bool _overlaps(const Request *req, const Request *queue, bool older);
+    static bool _overlap(const Request *a, const Request *b);
+    void _unlink(Request **queue, Request *req);
+    void _append(Request **queue, Request *req);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+#include "mbed.h"
+#include "AT45ReadStream.h"
+
+AT45ReadStream::AT45ReadStream(AT45 *at45, char *window, int chunk)
+    : _at45(at45), _window(window), _chunk(chunk), _address(0), _left(0), _inflight(0), _half(0),
+      _open(false), _skip(false), _done(false), _error(false)
+#if MBED_CONF_RTOS_PRESENT
+    , _ready(0, 1)
+#endif
+{
+}
+
+AT45ReadStream::~AT45ReadStream()
+{
+    close();
+}
+
+int AT45ReadStream::open(int address, int length)
+{
+    int pagesize = _at45->pagesize();
+
+    close();
+
+    if ((_chunk <= 0) || (pagesize <= 0) || (address < 0) || (length < 0) ||
+        (address + length > _at45->pages() * pagesize))
+    {
+        return -1;
+    }
+
+    _address = address;
+    _left = length;
+    _half = 0;
+    _skip = false;
+    _error = false;
+
+    if (_left == 0) {
+        return 0;
+    }
+
+    if (_at45->stream_open(address / pagesize, address % pagesize) != 0) {
+        return -1;
+    }
+
+    _open = true;
+    _start(); // the first chunk comes in while the caller gets ready
+
+    return 0;
+}
+
+const char *AT45ReadStream::next(int *length)
+{
+    if (!_inflight) {
+        *length = _error ? -1 : 0;
+        return NULL;
+    }
+
+    _wait();
+
+    if (_error) {
+        close();
+        *length = -1;
+        return NULL;
+    }
+
+    const char *data = _window + _half * _chunk;
+    *length = _inflight;
+
+    _inflight = 0;
+    _half ^= 1;
+
+    if (_left > 0) {
+        _start(); // the chunk after this one comes in while the caller works on this one
+    } else {
+        close();
+    }
+
+    return data;
+}
+
+void AT45ReadStream::close()
+{
+#if DEVICE_SPI_ASYNCH
+    if (_inflight) {
+        _wait(); // the transfer writes into the window
+    }
+#endif
+
+    _inflight = 0;
+    _left = 0;
+
+    if (_open) {
+        _at45->stream_close();
+        _open = false;
+    }
+}
+
+// Start clocking the next chunk into the free half of the window
+void AT45ReadStream::_start()
+{
+    int pagesize = _at45->pagesize();
+    int n = (_left < _chunk) ? _left : _chunk;
+
+    if (_at45->sparesize() > 0) {
+        // binary view, clock past the spare bytes between the pages
+        if (_skip) {
+            char spare[32];
+
+            _at45->stream_read(spare, _at45->sparesize());
+            _skip = false;
+        }
+
+        if (n > pagesize - (_address % pagesize)) {
+            n = pagesize - (_address % pagesize);
+        }
+    }
+
+    _address += n;
+    _left -= n;
+    _skip = ((_address % pagesize) == 0);
+
+    _inflight = n;
+    _done = false;
+
+#if DEVICE_SPI_ASYNCH
+    if (_at45->stream_read_async(_window + _half * _chunk, n, mbed::callback(this, &AT45ReadStream::_complete)) != 0) {
+        _error = true;
+        _done = true;
+    }
+#endif
+}
+
+// Wait for the chunk in flight, or clock it in without SPI asynch
+void AT45ReadStream::_wait()
+{
+#if DEVICE_SPI_ASYNCH
+#if MBED_CONF_RTOS_PRESENT
+    while (!_done) {
+        _ready.wait();
+    }
+#else
+    while (!_done);
+#endif
+#else
+    _at45->stream_read(_window + _half * _chunk, _inflight);
+    _done = true;
+#endif
+}
+
+#if DEVICE_SPI_ASYNCH
+void AT45ReadStream::_complete(int event)
+{
+    if (event & SPI_EVENT_ERROR) {
+        _error = true;
+    }
+
+    _done = true;
+
+#if MBED_CONF_RTOS_PRESENT
+    _ready.release();
+#endif
+}
+#endif
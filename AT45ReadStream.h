@@ -0,0 +1,91 @@
+#ifndef AT45_READ_STREAM_H
+#define AT45_READ_STREAM_H
+
+#include "mbed.h"
+#include "AT45.h"
+
+/** Sequential reader over an AT45 through one open continuous array read
+ *
+ *  The range is clocked out by one continuous array read (0x0B) that stays
+ *  open between chunks, chip select held low. Chunks are handed out from a
+ *  small window of two chunks: with SPI asynch the next chunk is clocked
+ *  into one half while the caller works on the other, so hashing or
+ *  parsing a large image runs at the speed of the bus with a few hundred
+ *  bytes of RAM.
+ *
+ *  In the binary view the spare bytes of each page are clocked past, a
+ *  chunk ends at the end of the page data at the latest.
+ *
+ *  The SPI bus stays locked while the stream is open, so do not use the
+ *  device through anything else until close(), or the end of the range.
+ *
+ *  @code
+ *  char window[2 * 128];
+ *  AT45ReadStream stream(&at45, window, 128);
+ *  const char *chunk;
+ *  int length;
+ *
+ *  stream.open(0, image_size);
+ *  while ((chunk = stream.next(&length)) != NULL) {
+ *      sha256.update(chunk, length);
+ *  }
+ *  @endcode
+ */
+class AT45ReadStream {
+public:
+    /** Create a stream over an AT45
+     *
+     *  @param at45     The device
+     *  @param window   Buffer of 2 x chunk bytes, valid for the life of the stream
+     *  @param chunk    Size of the chunks handed out
+     */
+    AT45ReadStream(AT45 *at45, char *window, int chunk);
+
+    ~AT45ReadStream();
+
+    /** Start reading a range
+     *
+     *  @param address  Byte address of the first byte (page * page size + offset in page)
+     *  @param length   Number of bytes in the range
+     *  @return         0 on success or -1 for error
+     */
+    int open(int address, int length);
+
+    /** Get the next chunk
+     *
+     *  The chunk stays valid until the next call, which also starts the
+     *  transfer of the chunk after it.
+     *
+     *  @param length   Receives the size of the chunk, 0 at the end of the range or -1 for error
+     *  @return         The chunk, or NULL at the end of the range or on error
+     */
+    const char *next(int *length);
+
+    /** End the read, the stream closes by itself at the end of the range
+     */
+    void close();
+
+private:
+    AT45 *_at45;
+    char *_window;
+    int _chunk;
+    int _address;           // byte address after the last chunk started
+    int _left;              // bytes of the range not started yet
+    int _inflight;          // size of the chunk being clocked in, 0 when none
+    int _half;              // half of the window the chunk is clocked into
+    bool _open;             // the continuous read is open
+    bool _skip;             // the spare bytes of a page are next on the bus
+    volatile bool _done;    // the chunk has been clocked in
+    volatile bool _error;   // the transfer failed
+#if MBED_CONF_RTOS_PRESENT
+    Semaphore _ready;       // released when the chunk has been clocked in
+#endif
+
+    void _start(void);
+    void _wait(void);
+#if DEVICE_SPI_ASYNCH
+    void _complete(int event);
+#endif
+};
+
+#endif
@@ -0,0 +1,434 @@
+#include "mbed.h"
+#include "AT45WearLevelingBlockDevice.h"
+
+#define AT45_WEAR_UNMAPPED      0xffff
+#define AT45_WEAR_TRIMMED       0x8000      // in the map, the physical page holds an unmap record of the logical page
+#define AT45_WEAR_PHYSICAL_MASK 0x7fff      // physical page bits of the map
+#define AT45_WEAR_ERASED_SEQ    0xffffffff  // sequence number of a page never programmed through the layer
+#define AT45_WEAR_PAGE_MASK     0x1fff      // logical page bits of the page word
+#define AT45_WEAR_COUNT_SHIFT   13          // erase count bits of the page word
+#define AT45_WEAR_COUNT_MAX     0x3ffff     // erase count bits 13-30
+#define AT45_WEAR_TRIM          0x80000000  // bit of the page word set in an unmap record
+#define AT45_WEAR_SCAN_PAGES    8           // spare areas read per scan step
+
+AT45WearLevelingBlockDevice::AT45WearLevelingBlockDevice(AT45BlockDevice *bd, int reserve)
+    : _bd(bd), _at45(NULL), _reserve(reserve), _pages(0), _logical(0), _pagesize(0), _sparesize(0),
+      _sectorpages(0), _rewrite_interval(0), _map(NULL), _used(NULL), _programs(NULL), _rewrite(NULL),
+      _cursor(0), _seq(0)
+{
+}
+
+AT45WearLevelingBlockDevice::~AT45WearLevelingBlockDevice()
+{
+    deinit();
+}
+
+int AT45WearLevelingBlockDevice::init()
+{
+    if (_map) {
+        return BD_ERROR_OK;
+    }
+
+    // the tags take the spare bytes
+    int r = _bd->set_integrity(false);
+    if (r == 0) {
+        r = _bd->set_binary_view(true);
+    }
+    if (r == 0) {
+        r = _bd->init();
+    }
+    if (r != 0) {
+        return r;
+    }
+
+    _at45 = &_bd->at45;
+    // the last page of a 32768 page part would read as an unmap record in the map
+    _pages = (_at45->pages() < AT45_WEAR_PHYSICAL_MASK) ? _at45->pages() : AT45_WEAR_PHYSICAL_MASK;
+    _pagesize = _at45->pagesize();
+    _sparesize = _at45->sparesize();
+
+    int reserve = _reserve ? _reserve : (_pages / AT45_WEAR_RESERVE_DIV);
+    if (reserve < 1) {
+        reserve = 1;
+    }
+
+    if ((_sparesize < AT45_WEAR_TAG_SIZE) || (reserve >= _pages) || (_at45->sectors() <= 0)) {
+        // a chip configured for binary page sizes has no spare bytes
+        _bd->deinit();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _logical = _pages - reserve;
+    _sectorpages = _at45->pages() / _at45->sectors();
+    _rewrite_interval = AT45_WEAR_REWRITE_PROGRAMS / _sectorpages;
+    if (_rewrite_interval < 1) {
+        _rewrite_interval = 1;
+    }
+
+    _map = (uint16_t*)malloc(_logical * sizeof(uint16_t));
+    _used = (uint32_t*)malloc(((_pages + 31) / 32) * sizeof(uint32_t));
+    _programs = (uint16_t*)malloc(_at45->sectors() * sizeof(uint16_t));
+    _rewrite = (uint16_t*)malloc(_at45->sectors() * sizeof(uint16_t));
+
+    if (!_map || !_used || !_programs || !_rewrite) {
+        _release();
+        _bd->deinit();
+        return AT45_OUT_OF_MEMORY;
+    }
+
+    {
+        AT45BlockDevice::Access access(_bd);
+        r = _scan();
+    }
+
+    if (r != 0) {
+        _release();
+        _bd->deinit();
+        return r;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45WearLevelingBlockDevice::deinit()
+{
+    if (!_map) {
+        return BD_ERROR_OK;
+    }
+
+    _release();
+
+    return _bd->deinit();
+}
+
+int AT45WearLevelingBlockDevice::sync()
+{
+    return _bd->sync();
+}
+
+int AT45WearLevelingBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    AT45BlockDevice::Access access(_bd);
+
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    char *data = (char*)buffer;
+    int page = addr / _pagesize;
+    int count = size / _pagesize;
+
+    for (int i = 0; i < count; i++) {
+        if (_map[page + i] & AT45_WEAR_TRIMMED) {
+            memset(data, 0xff, _pagesize); // never programmed, or unmapped
+        } else {
+            int r = _at45->read_page(data, _map[page + i]);
+            if (r != 0) {
+                return r;
+            }
+        }
+
+        data += _pagesize;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45WearLevelingBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    AT45BlockDevice::Access access(_bd);
+
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    const char *data = (const char*)buffer;
+    int page = addr / _pagesize;
+    int count = size / _pagesize;
+
+    for (int i = 0; i < count; i++) {
+        int r = _write(page + i, data);
+        if (r != 0) {
+            return r;
+        }
+
+        data += _pagesize;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45WearLevelingBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    AT45BlockDevice::Access access(_bd);
+
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    int page = addr / _pagesize;
+    int count = size / _pagesize;
+
+    for (int i = 0; i < count; i++) {
+        if (!(_map[page + i] & AT45_WEAR_TRIMMED)) {
+            // an unmap record newer than every copy left behind, so none comes back after a reset
+            int r = _write(page + i, NULL);
+            if (r != 0) {
+                return r;
+            }
+        }
+    }
+
+    return BD_ERROR_OK;
+}
+
+int AT45WearLevelingBlockDevice::format()
+{
+    if (!_map) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    AT45BlockDevice::Access access(_bd);
+
+    if (_at45->erase_pages(0, _pages) != 0) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    return _scan();
+}
+
+int AT45WearLevelingBlockDevice::get_erase_counts(uint32_t *min, uint32_t *max)
+{
+    if (!_map) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    AT45BlockDevice::Access access(_bd);
+
+    char spare[AT45_WEAR_SCAN_PAGES * 32];
+
+    *min = AT45_WEAR_COUNT_MAX;
+    *max = 0;
+
+    for (int page = 0; page < _pages; page += AT45_WEAR_SCAN_PAGES) {
+        int count = (_pages - page < AT45_WEAR_SCAN_PAGES) ? (_pages - page) : AT45_WEAR_SCAN_PAGES;
+
+        if (_at45->read_spares(spare, page, count) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const char *tag = spare + i * _sparesize;
+            uint32_t erases = 0;
+
+            if (AT45::get_word(tag + AT45_WEAR_TAG_SEQ) != AT45_WEAR_ERASED_SEQ) {
+                erases = (AT45::get_word(tag + AT45_WEAR_TAG_PAGE) >> AT45_WEAR_COUNT_SHIFT) & AT45_WEAR_COUNT_MAX;
+            }
+
+            if (erases < *min) {
+                *min = erases;
+            }
+            if (erases > *max) {
+                *max = erases;
+            }
+        }
+    }
+
+    return BD_ERROR_OK;
+}
+
+bd_size_t AT45WearLevelingBlockDevice::get_read_size() const
+{
+    return _pagesize;
+}
+
+bd_size_t AT45WearLevelingBlockDevice::get_program_size() const
+{
+    return _pagesize;
+}
+
+bd_size_t AT45WearLevelingBlockDevice::get_erase_size() const
+{
+    return _pagesize;
+}
+
+int AT45WearLevelingBlockDevice::get_erase_value() const
+{
+    return 0xFF;
+}
+
+bd_size_t AT45WearLevelingBlockDevice::size() const
+{
+    return (bd_size_t)_logical * _pagesize;
+}
+
+// Rebuild the mapping from the tags, the newest copy of each logical page wins
+int AT45WearLevelingBlockDevice::_scan()
+{
+    char spare[AT45_WEAR_SCAN_PAGES * 32];
+
+    for (int i = 0; i < _logical; i++) {
+        _map[i] = AT45_WEAR_UNMAPPED;
+    }
+    memset(_used, 0, ((_pages + 31) / 32) * sizeof(uint32_t));
+    memset(_programs, 0, _at45->sectors() * sizeof(uint16_t));
+    memset(_rewrite, 0, _at45->sectors() * sizeof(uint16_t));
+
+    _seq = 0;
+    _cursor = 0;
+
+    for (int page = 0; page < _pages; page += AT45_WEAR_SCAN_PAGES) {
+        int count = (_pages - page < AT45_WEAR_SCAN_PAGES) ? (_pages - page) : AT45_WEAR_SCAN_PAGES;
+
+        if (_at45->read_spares(spare, page, count) != 0) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const char *tag = spare + i * _sparesize;
+            uint32_t seq = AT45::get_word(tag + AT45_WEAR_TAG_SEQ);
+            uint32_t word = AT45::get_word(tag + AT45_WEAR_TAG_PAGE);
+            int logical = word & AT45_WEAR_PAGE_MASK;
+            int physical = page + i;
+
+            if (seq == AT45_WEAR_ERASED_SEQ) {
+                continue;
+            }
+
+            if (seq >= _seq) {
+                // carry on programming after the last page programmed
+                _seq = seq + 1;
+                _cursor = (physical + 1 < _pages) ? (physical + 1) : 0;
+            }
+
+            if (logical >= _logical) {
+                continue; // with a larger reserve than when it was programmed
+            }
+
+            if (_map[logical] != AT45_WEAR_UNMAPPED) {
+                // every program leaves the previous copy behind
+                char other[32];
+
+                if (_at45->read_spare(other, _map[logical] & AT45_WEAR_PHYSICAL_MASK) != 0) {
+                    return BD_ERROR_DEVICE_ERROR;
+                }
+
+                if (AT45::get_word(other + AT45_WEAR_TAG_SEQ) > seq) {
+                    continue;
+                }
+
+                _setused(_map[logical] & AT45_WEAR_PHYSICAL_MASK, false);
+            }
+
+            // an unmap record keeps its page until the logical page is programmed again
+            _map[logical] = physical | ((word & AT45_WEAR_TRIM) ? AT45_WEAR_TRIMMED : 0);
+            _setused(physical, true);
+        }
+    }
+
+    return BD_ERROR_OK;
+}
+
+// Program a logical page into the next free physical page, or an unmap record of it without data
+int AT45WearLevelingBlockDevice::_write(int page, const char *data)
+{
+    char tag[32]; // the largest spare area, 1056 byte pages
+
+    int physical = _allocate();
+    if (physical < 0) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    // the erase count so far, the tag of the copy the page last held
+    if (_at45->read_spare(tag, physical) != 0) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    uint32_t erases = 0;
+    if (AT45::get_word(tag + AT45_WEAR_TAG_SEQ) != AT45_WEAR_ERASED_SEQ) {
+        erases = (AT45::get_word(tag + AT45_WEAR_TAG_PAGE) >> AT45_WEAR_COUNT_SHIFT) & AT45_WEAR_COUNT_MAX;
+    }
+    if (erases < AT45_WEAR_COUNT_MAX) {
+        erases++; // the built-in erase of this program
+    }
+
+    memset(tag, 0xff, sizeof(tag));
+    AT45::put_word(tag + AT45_WEAR_TAG_SEQ, _seq++);
+    AT45::put_word(tag + AT45_WEAR_TAG_PAGE, page | (erases << AT45_WEAR_COUNT_SHIFT) | (data ? 0 : AT45_WEAR_TRIM));
+
+    int r = _at45->write_page_spare(data, tag, physical, true);
+    if (r != 0) {
+        return r;
+    }
+
+    if (_map[page] != AT45_WEAR_UNMAPPED) {
+        _setused(_map[page] & AT45_WEAR_PHYSICAL_MASK, false); // the copy, or the unmap record, it replaces
+    }
+
+    _map[page] = physical | (data ? 0 : AT45_WEAR_TRIMMED);
+    _setused(physical, true);
+
+    _refresh(physical);
+
+    return BD_ERROR_OK;
+}
+
+// The next physical page not holding a logical page, round robin
+int AT45WearLevelingBlockDevice::_allocate()
+{
+    for (int i = 0; i < _pages; i++) {
+        int physical = _cursor;
+
+        _cursor = (_cursor + 1 < _pages) ? (_cursor + 1) : 0;
+
+        if (!_inuse(physical)) {
+            return physical;
+        }
+    }
+
+    return -1;
+}
+
+// Count a program in the sector of a page, and rewrite the next page of the sector when due,
+// free pages included as the tags of old copies are read back by _scan
+void AT45WearLevelingBlockDevice::_refresh(int physical)
+{
+    int sector = physical / _sectorpages;
+
+    if (sector >= _at45->sectors()) {
+        sector = _at45->sectors() - 1;
+    }
+
+    if (++_programs[sector] < _rewrite_interval) {
+        return;
+    }
+
+    _programs[sector] = 0;
+
+    _at45->page_rewrite(sector * _sectorpages + _rewrite[sector]);
+
+    if (++_rewrite[sector] >= _sectorpages) {
+        _rewrite[sector] = 0;
+    }
+}
+
+bool AT45WearLevelingBlockDevice::_inuse(int physical) const
+{
+    return (_used[physical / 32] & (1UL << (physical % 32))) != 0;
+}
+
+void AT45WearLevelingBlockDevice::_setused(int physical, bool used)
+{
+    if (used) {
+        _used[physical / 32] |= (1UL << (physical % 32));
+    } else {
+        _used[physical / 32] &= ~(1UL << (physical % 32));
+    }
+}
+
+void AT45WearLevelingBlockDevice::_release()
+{
+    free(_map);
+    free(_used);
+    free(_programs);
+    free(_rewrite);
+
+    _map = NULL;
+    _used = NULL;
+    _programs = NULL;
+    _rewrite = NULL;
+}
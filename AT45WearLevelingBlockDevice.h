@@ -0,0 +1,178 @@
+#ifndef AT45_WEAR_LEVELING_BLOCK_DEVICE_H
+#define AT45_WEAR_LEVELING_BLOCK_DEVICE_H
+
+#include "mbed.h"
+#include "AT45BlockDevice.h"
+
+// Tag in the spare bytes of each physical page, little endian words
+#define AT45_WEAR_TAG_SEQ       0   // sequence number of the page program, all ones when never programmed
+#define AT45_WEAR_TAG_PAGE      4   // logical page in bits 0-12, erase count in bits 13-30, bit 31 set in an unmap record
+#define AT45_WEAR_TAG_SIZE      8   // fits the 8 spare bytes of 264 byte pages
+
+#if !defined(AT45_WEAR_REWRITE_PROGRAMS)
+#define AT45_WEAR_REWRITE_PROGRAMS  10000   // every page of a sector is rewritten within this many programs of the sector
+#endif
+
+#if !defined(AT45_WEAR_RESERVE_DIV)
+#define AT45_WEAR_RESERVE_DIV   32      // default share of the pages kept free, 1 in 32
+#endif
+
+/** Wear leveling flash translation layer on an AT45BlockDevice
+ *
+ *  Logical pages are remapped to physical pages. Every program goes to the
+ *  next physical page not holding a logical page, round robin over the
+ *  device, so a page written over and over, such as a superblock, wears all
+ *  pages alike. The page is programmed together with a tag in its spare
+ *  bytes holding the logical page, a sequence number and the number of
+ *  times the physical page has been erased. The old copy is left as it is,
+ *  the highest sequence number wins.
+ *
+ *  init() rebuilds the mapping from the tags, reading only the spare bytes
+ *  of each page. The mapping takes 2 bytes of RAM per page.
+ *
+ *  Every page of a sector is refreshed with an auto page rewrite within
+ *  AT45_WEAR_REWRITE_PROGRAMS programs of the sector, half the 20,000
+ *  cumulative programs the datasheet allows, as the count restarts with
+ *  init().
+ *
+ *  Needs a DataFlash page size (264/528/1056 bytes), the binary view is
+ *  turned on by init() and blocks are 256/512/1024 bytes. erase() programs
+ *  an unmap record of each block, newer than every copy left behind, so an
+ *  erased block reads back erased after a reset as well. The record holds
+ *  its physical page until the block is programmed again.
+ */
+class AT45WearLevelingBlockDevice : public BlockDevice {
+public:
+    /** Create a translation layer on a block device
+     *
+     *  @param bd       The block device, only used through this one from here on
+     *  @param reserve  Physical pages kept free, 0 for 1 in AT45_WEAR_RESERVE_DIV
+     */
+    AT45WearLevelingBlockDevice(AT45BlockDevice *bd, int reserve = 0);
+
+    virtual ~AT45WearLevelingBlockDevice();
+
+    /** Initialize the block device and rebuild the mapping from the spare bytes
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Deinitialize the block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the block device
+     *
+     *  @param buffer   Buffer to read blocks into
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to the block device
+     *
+     *  No erase is needed first, each block goes to a fresh physical page.
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks on the block device
+     *
+     *  Unmaps the blocks with one page program each, blocks not holding
+     *  data are skipped. The erased blocks read back as 0xFF.
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Erase the whole chip, including the tags
+     *
+     *  Needed once before first use on a chip holding other data.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int format();
+
+    /** Lowest and highest erase count of the physical pages
+     *
+     *  Reads the spare bytes of every page.
+     *
+     *  @param min      Receives the lowest erase count
+     *  @param max      Receives the highest erase count
+     *  @return         0 on success or a negative error code on failure
+     */
+    int get_erase_counts(uint32_t *min, uint32_t *max);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of a eraseable block
+     *
+     *  @return         Size of a eraseable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of storage when erased
+     *
+     *  @return         0xFF, erased and never programmed blocks read back erased
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the total size of the logical pages
+     *
+     *  @return         Size of the device in bytes, less the reserved pages
+     */
+    virtual bd_size_t size() const;
+
+private:
+    AT45BlockDevice *_bd;
+    AT45 *_at45;
+    int _reserve;              // physical pages kept free, 0 for the default share
+    int _pages;                // physical pages
+    int _logical;              // logical pages
+    int _pagesize;             // bytes per block
+    int _sparesize;            // spare bytes per page
+    int _sectorpages;          // physical pages per sector
+    int _rewrite_interval;     // sector programs between two page rewrites in the sector
+    uint16_t *_map;            // physical page of each logical page, flagged when it holds an unmap record, 0xffff when never programmed
+    uint32_t *_used;           // bitmap of the physical pages holding a logical page or its unmap record
+    uint16_t *_programs;       // programs per sector since its last page rewrite
+    uint16_t *_rewrite;        // next page to rewrite in each sector, from the start of the sector
+    int _cursor;               // physical page the search for a free page starts from
+    uint32_t _seq;             // sequence number of the next program
+
+    int _scan(void);
+    int _write(int page, const char *data);
+    int _allocate(void);
+    void _refresh(int physical);
+    bool _inuse(int physical) const;
+    void _setused(int physical, bool used);
+    void _release(void);
+};
+
+#endif
@@ -36,15 +36,39 @@
          _bits(8),
          _mode(0),
          _hz(1000000),
-         _write_fill(SPI_FILL_CHAR) {
+         _write_fill(SPI_FILL_CHAR),
+         _freed(false) {
      // No lock needed in the constructor
+     _pins[0] = mosi;
+     _pins[1] = miso;
+     _pins[2] = sclk;
+     _pins[3] = ssel;
 
      spi_init(&_spi, mosi, miso, sclk, ssel);
      _acquire();
  }
 
  void DestructableSPI::free() {
-     spi_free(&_spi);
+     lock();
+     if (!_freed) {
+         spi_free(&_spi);
+         _freed = true;
+         if (_owner == this) {
+             _owner = NULL;
+         }
+     }
+     unlock();
+ }
+
+ void DestructableSPI::init() {
+     lock();
+     if (_freed) {
+         spi_init(&_spi, _pins[0], _pins[1], _pins[2], _pins[3]);
+         _freed = false;
+         _owner = NULL; // the new peripheral needs the format and frequency
+         _acquire();
+     }
+     unlock();
  }
 
  void DestructableSPI::format(int bits, int mode) {
@@ -93,6 +93,12 @@
       */
      void free();
 
+     /**
+      * Create the underlying SPI interface again after free(),
+      * with the last format and frequency. Does nothing otherwise.
+      */
+     void init();
+
      /** Destruct the SPI master
       */
      /** Configure the data transmission format
@@ -284,6 +290,8 @@
      int _mode;
      int _hz;
      char _write_fill;
+     PinName _pins[4];  // mosi, miso, sclk and ssel, for init() after free()
+     bool _freed;
 
  private:
      /* Private acquire function without locking/unlocking
@@ -0,0 +1,316 @@
+/* Throughput and latency of an AT45 on the target
+ *
+ * Sequential and random reads and programs and erases of a range of pages,
+ * on the raw AT45 and through AT45BlockDevice, then the cost of mounting
+ * LittleFS and appending small records to a file. Each result goes to the
+ * host as a greentea KV pair in bytes per second (or us), followed by the
+ * counters of the block device, one KV pair per value, and format_stats() as
+ * a plain line of JSON. Build with AT45_STATS_ENABLED=1 for the per operation
+ * latencies. The geometry of the part is reported first, so runs on boards
+ * with different densities can be told apart.
+ *
+ * DESTRUCTIVE, the contents of the device are lost.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+#include "AT45.h"
+#include "AT45BlockDevice.h"
+#include "LittleFileSystem.h"
+
+using namespace utest::v1;
+
+#if !defined(MBED_CONF_APP_AT45_MOSI)
+#define MBED_CONF_APP_AT45_MOSI     SPI_MOSI
+#endif
+
+#if !defined(MBED_CONF_APP_AT45_MISO)
+#define MBED_CONF_APP_AT45_MISO     SPI_MISO
+#endif
+
+#if !defined(MBED_CONF_APP_AT45_SCK)
+#define MBED_CONF_APP_AT45_SCK      SPI_SCK
+#endif
+
+#if !defined(MBED_CONF_APP_AT45_CS)
+#define MBED_CONF_APP_AT45_CS       SPI_CS
+#endif
+
+#define BENCH_PAGES         64      // pages covered by each run, a multiple of the 8 page block
+#define BENCH_RANDOM_OPS    64      // operations of each random run
+#define BENCH_RECORD        32      // bytes per file append
+#define BENCH_RECORDS       64      // appends of the file run
+#define BENCH_STATS_SIZE    1024
+
+static char page_buffer[1056];      // largest page
+static char stats_buffer[BENCH_STATS_SIZE];
+static uint32_t lcg = 1;
+
+// created once the raw cases have released the SPI interface, stays initialized until the file system takes it over
+static AT45BlockDevice *bd = NULL;
+
+// pseudo random page of the range, the same sequence on every run
+static int random_page(void)
+{
+    lcg = lcg * 1103515245 + 12345;
+    return (lcg >> 16) % BENCH_PAGES;
+}
+
+static void report_rate(const char *key, uint32_t bytes, uint32_t us)
+{
+    greentea_send_kv(key, (int)(us ? ((uint64_t)bytes * 1000000 / us) : 0));
+}
+
+static void fill(char *data, int size, int seed)
+{
+    for (int i = 0; i < size; i++) {
+        data[i] = (char)(i + seed);
+    }
+}
+
+// one raw device for the duration of a test case, the SPI interface is released with it
+class RawDevice {
+public:
+    RawDevice()
+        : spi(MBED_CONF_APP_AT45_MOSI, MBED_CONF_APP_AT45_MISO, MBED_CONF_APP_AT45_SCK),
+          at45(&spi, MBED_CONF_APP_AT45_CS, AT45::PART_UNKNOWN, false)
+    {
+        spi.format(8, MBED_CONF_AT45_SPI_MODE);
+        spi.frequency(MBED_CONF_AT45_SPI_FREQUENCY);
+    }
+
+    ~RawDevice()
+    {
+        at45.busy();
+        spi.free();
+    }
+
+    DestructableSPI spi;
+    AT45 at45;
+};
+
+static void send_op(const char *name, const at45_op_stats_t *op)
+{
+    char key[24];
+
+    snprintf(key, sizeof(key), "%s_count", name);
+    greentea_send_kv(key, (int)op->count);
+    snprintf(key, sizeof(key), "%s_max_us", name);
+    greentea_send_kv(key, (int)op->max_us);
+    snprintf(key, sizeof(key), "%s_p50_us", name);
+    greentea_send_kv(key, (int)AT45::stats_percentile(op, 50));
+    snprintf(key, sizeof(key), "%s_p99_us", name);
+    greentea_send_kv(key, (int)AT45::stats_percentile(op, 99));
+}
+
+void test_raw_geometry()
+{
+    RawDevice raw;
+    TEST_ASSERT_EQUAL(0, raw.at45.probe());
+    TEST_ASSERT(raw.at45.pagesize() <= (int)sizeof(page_buffer));
+
+    greentea_send_kv("at45_id", raw.at45.id());
+    greentea_send_kv("at45_pages", raw.at45.pages());
+    greentea_send_kv("at45_pagesize", raw.at45.pagesize());
+}
+
+void test_raw_sequential()
+{
+    RawDevice raw;
+    TEST_ASSERT_EQUAL(0, raw.at45.probe());
+
+    int pagesize = raw.at45.pagesize();
+    Timer timer;
+
+    timer.start();
+    TEST_ASSERT_EQUAL(0, raw.at45.erase_pages(0, BENCH_PAGES));
+    raw.at45.busy();
+    report_rate("raw_seq_erase_Bps", BENCH_PAGES * pagesize, timer.read_us());
+
+    fill(page_buffer, pagesize, 0);
+    timer.reset();
+    for (int page = 0; page < BENCH_PAGES; page++) {
+        TEST_ASSERT_EQUAL(0, raw.at45.write_page(page_buffer, page, false));
+    }
+    raw.at45.busy();
+    report_rate("raw_seq_program_Bps", BENCH_PAGES * pagesize, timer.read_us());
+
+    timer.reset();
+    for (int page = 0; page < BENCH_PAGES; page++) {
+        TEST_ASSERT_EQUAL(0, raw.at45.read_bytes(page * pagesize, page_buffer, pagesize));
+    }
+    report_rate("raw_seq_read_Bps", BENCH_PAGES * pagesize, timer.read_us());
+}
+
+void test_raw_random()
+{
+    RawDevice raw;
+    TEST_ASSERT_EQUAL(0, raw.at45.probe());
+
+    int pagesize = raw.at45.pagesize();
+    Timer timer;
+
+    lcg = 1;
+    fill(page_buffer, pagesize, 1);
+    timer.start();
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        TEST_ASSERT_EQUAL(0, raw.at45.write_page(page_buffer, random_page(), true));
+    }
+    raw.at45.busy();
+    report_rate("raw_rand_program_Bps", BENCH_RANDOM_OPS * pagesize, timer.read_us());
+
+    lcg = 1;
+    timer.reset();
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        TEST_ASSERT_EQUAL(0, raw.at45.read_page(page_buffer, random_page()));
+    }
+    report_rate("raw_rand_read_Bps", BENCH_RANDOM_OPS * pagesize, timer.read_us());
+
+    lcg = 1;
+    timer.reset();
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        TEST_ASSERT_EQUAL(0, raw.at45.erase_pages(random_page(), 1));
+    }
+    raw.at45.busy();
+    report_rate("raw_rand_erase_Bps", BENCH_RANDOM_OPS * pagesize, timer.read_us());
+}
+
+void test_bd_sequential()
+{
+    bd = new AT45BlockDevice(MBED_CONF_APP_AT45_MOSI, MBED_CONF_APP_AT45_MISO,
+                             MBED_CONF_APP_AT45_SCK, MBED_CONF_APP_AT45_CS);
+    TEST_ASSERT_EQUAL(0, bd->init());
+    bd->reset_stats();
+
+    bd_size_t pagesize = bd->get_program_size();
+    Timer timer;
+
+    timer.start();
+    TEST_ASSERT_EQUAL(0, bd->erase(0, BENCH_PAGES * pagesize));
+    TEST_ASSERT_EQUAL(0, bd->sync());
+    report_rate("bd_seq_erase_Bps", BENCH_PAGES * pagesize, timer.read_us());
+
+    fill(page_buffer, pagesize, 2);
+    timer.reset();
+    for (int page = 0; page < BENCH_PAGES; page++) {
+        TEST_ASSERT_EQUAL(0, bd->program(page_buffer, page * pagesize, pagesize));
+    }
+    TEST_ASSERT_EQUAL(0, bd->sync());
+    report_rate("bd_seq_program_Bps", BENCH_PAGES * pagesize, timer.read_us());
+
+    timer.reset();
+    for (int page = 0; page < BENCH_PAGES; page++) {
+        TEST_ASSERT_EQUAL(0, bd->read(page_buffer, page * pagesize, pagesize));
+    }
+    report_rate("bd_seq_read_Bps", BENCH_PAGES * pagesize, timer.read_us());
+}
+
+void test_bd_random()
+{
+    TEST_ASSERT(bd != NULL);
+
+    bd_size_t pagesize = bd->get_program_size();
+    Timer timer;
+
+    lcg = 1;
+    fill(page_buffer, pagesize, 3);
+    timer.start();
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        TEST_ASSERT_EQUAL(0, bd->program(page_buffer, random_page() * pagesize, pagesize));
+    }
+    TEST_ASSERT_EQUAL(0, bd->sync());
+    report_rate("bd_rand_program_Bps", BENCH_RANDOM_OPS * pagesize, timer.read_us());
+
+    lcg = 1;
+    timer.reset();
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        TEST_ASSERT_EQUAL(0, bd->read(page_buffer, random_page() * pagesize, pagesize));
+    }
+    report_rate("bd_rand_read_Bps", BENCH_RANDOM_OPS * pagesize, timer.read_us());
+
+    lcg = 1;
+    timer.reset();
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        TEST_ASSERT_EQUAL(0, bd->erase(random_page() * pagesize, pagesize));
+    }
+    TEST_ASSERT_EQUAL(0, bd->sync());
+    report_rate("bd_rand_erase_Bps", BENCH_RANDOM_OPS * pagesize, timer.read_us());
+}
+
+void test_littlefs()
+{
+    LittleFileSystem fs("at45");
+    Timer timer;
+    char record[BENCH_RECORD];
+
+    // format and mount init and deinit the block device themselves, init() sets the SPI interface up again
+    TEST_ASSERT(bd != NULL);
+    TEST_ASSERT_EQUAL(0, LittleFileSystem::format(bd));
+
+    timer.start();
+    TEST_ASSERT_EQUAL(0, fs.mount(bd));
+    greentea_send_kv("lfs_mount_us", timer.read_us());
+
+    FILE *f = fopen("/at45/log", "a");
+    TEST_ASSERT(f != NULL);
+
+    fill(record, sizeof(record), 4);
+    timer.reset();
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        TEST_ASSERT_EQUAL(sizeof(record), fwrite(record, 1, sizeof(record), f));
+        TEST_ASSERT_EQUAL(0, fflush(f));
+    }
+    uint32_t us = timer.read_us();
+    greentea_send_kv("lfs_append_us", us / BENCH_RECORDS);
+    report_rate("lfs_append_Bps", BENCH_RECORDS * sizeof(record), us);
+
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    TEST_ASSERT_EQUAL(0, fs.unmount());
+}
+
+void test_stats()
+{
+    TEST_ASSERT(bd != NULL);
+
+    // counters of the block device runs and the file system on top of it
+    AT45BlockDevice::Stats stats = bd->get_stats();
+
+    send_op("read", &stats.device.read);
+    send_op("program", &stats.device.program);
+    send_op("erase", &stats.device.erase);
+    send_op("status", &stats.device.status);
+    greentea_send_kv("busy_waits", (int)stats.device.busy_waits);
+    greentea_send_kv("cache_hits", (int)stats.cache.hits);
+    greentea_send_kv("cache_misses", (int)stats.cache.misses);
+
+    // the host reads KV pairs up to the first '}', the JSON goes out as a plain line
+    int n = bd->format_stats(stats_buffer, sizeof(stats_buffer));
+    TEST_ASSERT(n > 0);
+    TEST_ASSERT(n < (int)sizeof(stats_buffer));
+
+    printf("at45_stats %s\n", stats_buffer);
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(300, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("AT45 geometry", test_raw_geometry),
+    Case("AT45 sequential", test_raw_sequential),
+    Case("AT45 random", test_raw_random),
+    Case("AT45BlockDevice sequential", test_bd_sequential),
+    Case("AT45BlockDevice random", test_bd_random),
+    Case("LittleFS mount and append", test_littlefs),
+    Case("AT45BlockDevice stats", test_stats),
+};
+
+Specification specification(greentea_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}